@@ -0,0 +1,25 @@
+Import("env")
+
+# build the fuzz target with clang, libFuzzer provides main()
+env.Replace(
+    CC="clang",
+    CXX="clang++",
+    LINK="clang++"
+)
+
+env.Append(
+    CCFLAGS=["-g", "-O1", "-fsanitize=fuzzer,address,undefined"],
+    LINKFLAGS=["-fsanitize=fuzzer,address,undefined"]
+)
+
+# run it for a minute from the seed corpus, new inputs go in the build dir
+env.AddCustomTarget(
+    name="fuzz",
+    dependencies="$BUILD_DIR/${PROGNAME}${PROGSUFFIX}",
+    actions=[
+        "mkdir -p $BUILD_DIR/corpus",
+        "$BUILD_DIR/${PROGNAME}${PROGSUFFIX} -max_total_time=60 $BUILD_DIR/corpus test/fuzz/corpus"
+    ],
+    title="Fuzz",
+    description="Fuzz the config parsing and measurement maths"
+)
@@ -0,0 +1,322 @@
+/**
+  Flow sensor config parsing for the Open eXtensible Rack System
+
+  Arduino-free (header only, just needs ArduinoJson) so the same code runs
+  in the firmware and in the native unit tests and fuzz target
+
+  GitHub repository:
+    https://github.com/sumnerboy12/OXRS-BJ-FlowSensor-ESP-FW
+
+  Copyright 2023 Ben Jones <ben.jones12@gmail.com>
+*/
+
+#ifndef FLOW_CONFIG_H
+#define FLOW_CONFIG_H
+
+#include <stdio.h>
+#include <math.h>
+#include <ArduinoJson.h>
+#include "FlowMath.h"
+
+/*--------------------------- Constants -------------------------------*/
+// Selectable telemetry fields (bit positions in the field mask), window 
+// fields first then those sent once per message (boot and totals)
+#define   FIELD_SEQ                       0
+#define   FIELD_TIMESTAMP                 1
+#define   FIELD_ELAPSED                   2
+#define   FIELD_PULSES                    3
+#define   FIELD_VOLUME                    4
+#define   FIELD_RATE                      5
+#define   FIELD_RATE_CHANGE               6
+#define   FIELD_FREQUENCY                 7
+#define   FIELD_QUALITY                   8
+#define   FIELD_OVERFLOW                  9
+#define   FIELD_REVERSE_PULSES            10
+#define   FIELD_REVERSE_VOLUME            11
+#define   FIELD_NET_VOLUME                12
+#define   FIELD_REFERENCE_VOLUME          13
+#define   FIELD_FIRST_SEQ                 14
+#define   FIELD_MESSAGE_FIRST             15
+#define   FIELD_BOOT                      15
+#define   FIELD_TOTAL_VOLUME              16
+#define   FIELD_TOTAL_REVERSE             17
+#define   FIELD_TOTAL_NET                 18
+#define   FIELD_TARIFF                    19
+#define   FIELD_DRIFT                     20
+#define   FIELD_PUBLISH_FAILURES          21
+#define   FIELD_RESENDS                   22
+#define   FIELD_COUNT                     23
+
+// Everything except the timestamp by default
+#define   DEFAULT_TELEMETRY_FIELD_MASK    (((1UL << FIELD_COUNT) - 1) & ~(1UL << FIELD_TIMESTAMP))
+
+// Telemetry field keys, full and short (indexed by FIELD_xxx)
+const char * const FIELD_KEYS[FIELD_COUNT][2] = 
+{
+  { "seq",                    "s"   },
+  { "timestamp",              "t"   },
+  { "elapsedMs",              "e"   },
+  { "pulseCount",             "p"   },
+  { "volumeMls",              "v"   },
+  { "rateMlsPerMin",          "r"   },
+  { "rateChangeMlsPerMin",    "rc"  },
+  { "frequencyMhz",           "f"   },
+  { "quality",                "q"   },
+  { "overflowCount",          "o"   },
+  { "reversePulseCount",      "rp"  },
+  { "reverseVolumeMls",       "rv"  },
+  { "netVolumeMls",           "nv"  },
+  { "referenceVolumeMls",     "xv"  },
+  { "firstSeq",               "fs"  },
+  { "boot",                   "b"   },
+  { "totalVolumeMls",         "tv"  },
+  { "totalReverseVolumeMls",  "trv" },
+  { "totalNetVolumeMls",      "tnv" },
+  { "tariffVolumeMls",        "ttv" },
+  { "driftPermille",          "d"   },
+  { "publishFailures",        "pf"  },
+  { "resends",                "rs"  },
+};
+
+/*--------------------------- Values ----------------------------------*/
+// Each reader only updates the value if the key is present and valid, and
+// counts anything else as rejected, so bad input never replaces a good value
+
+template <typename T>
+bool readConfigInt(JsonVariant json, const char * key, int32_t minimum, int32_t maximum, T * value, uint8_t * rejected)
+{
+  if (!json.containsKey(key))
+    return false;
+
+  // Must be a whole number that fits, e.g. not 5e9, 1.5 or "abc"
+  JsonVariant item = json[key];
+  if (!item.is<int32_t>() || item.as<int32_t>() < minimum || item.as<int32_t>() > maximum)
+  {
+    (*rejected)++;
+    return false;
+  }
+
+  *value = (T)item.as<int32_t>();
+  return true;
+}
+
+inline bool readConfigFloat(JsonVariant json, const char * key, float minimum, float maximum, float * value, uint8_t * rejected)
+{
+  if (!json.containsKey(key))
+    return false;
+
+  // Any number (integer or not) within range, NaN fails both comparisons
+  JsonVariant item = json[key];
+  float number = item.as<float>();
+  if (!item.is<float>() || !(number >= minimum && number <= maximum))
+  {
+    (*rejected)++;
+    return false;
+  }
+
+  *value = number;
+  return true;
+}
+
+inline bool readConfigBool(JsonVariant json, const char * key, bool * value, uint8_t * rejected)
+{
+  if (!json.containsKey(key))
+    return false;
+
+  // Only true or false, as<bool>() would read anything else as false
+  if (!json[key].is<bool>())
+  {
+    (*rejected)++;
+    return false;
+  }
+
+  *value = json[key].as<bool>();
+  return true;
+}
+
+inline bool readConfigString(JsonVariant json, const char * key, const char * defaultValue, char * value, size_t size, uint8_t * rejected)
+{
+  if (!json.containsKey(key))
+    return false;
+
+  // Null restores the default, anything too long would be cut short so is rejected
+  const char * string = json[key].isNull() ? defaultValue : json[key].as<const char *>();
+  if (!string || strlen(string) >= size)
+  {
+    (*rejected)++;
+    return false;
+  }
+
+  snprintf(value, size, "%s", string);
+  return true;
+}
+
+/*--------------------------- Tariff bands ----------------------------*/
+inline bool parseTimeOfDay(const char * value, uint16_t * minute)
+{
+  unsigned int hours, minutes;
+  char trailing;
+  if (!value || sscanf(value, "%2u:%2u%c", &hours, &minutes, &trailing) != 2 || minutes > 59 || hours * 60 + minutes > TARIFF_MINUTE_MAX)
+    return false;
+
+  *minute = hours * 60 + minutes;
+  return true;
+}
+
+inline bool parseTariffBands(JsonVariant json, configRecord * config)
+{
+  if (!json.is<JsonArray>() || json.size() > TARIFF_BAND_MAX)
+    return false;
+
+  // Parse into a copy, so the current bands stay if any item is invalid
+  tariffBand bands[TARIFF_BAND_MAX];
+  memset(bands, 0, sizeof(bands));
+  uint8_t count = 0;
+  for (JsonVariant item : json.as<JsonArray>())
+  {
+    tariffBand * band = &bands[count++];
+
+    const char * days = item.containsKey("days") ? item["days"].as<const char *>() : "all";
+    if (!days)
+    {
+      return false;
+    }
+    else if (strcmp(days, "weekday") == 0)
+    {
+      band->days = TARIFF_DAYS_WEEKDAY;
+    }
+    else if (strcmp(days, "weekend") == 0)
+    {
+      band->days = TARIFF_DAYS_WEEKEND;
+    }
+    else if (strcmp(days, "all") == 0)
+    {
+      band->days = TARIFF_DAYS_ALL;
+    }
+    else
+    {
+      return false;
+    }
+
+    if (!parseTimeOfDay(item["start"], &band->startMinute) || !parseTimeOfDay(item["end"], &band->endMinute))
+      return false;
+  }
+
+  config->tariffBandCount = count;
+  memcpy(config->tariffBands, bands, sizeof(bands));
+  return true;
+}
+
+/*--------------------------- Measurement config ----------------------*/
+inline uint8_t parseMeasurementConfig(JsonVariant json, configRecord * config)
+{
+  // Update the current config from whatever keys are present, returning how
+  // many values were rejected (each keeps its previous value)
+  uint8_t rejected = 0;
+
+  readConfigInt(json, "telemetryIntervalMs", 1, TELEMETRY_INTERVAL_MS_MAX, &config->telemetryIntervalMs, &rejected);
+  readConfigInt(json, "kFactor", 1, K_FACTOR_MAX, &config->kFactor, &rejected);
+  readConfigInt(json, "rateFilterGain", 1, RATE_FILTER_GAIN_MAX, &config->rateFilterGain, &rejected);
+  readConfigInt(json, "referenceKFactor", 0, K_FACTOR_MAX, &config->referenceKFactor, &rejected);
+  readConfigInt(json, "driftAlertPermille", 1, DRIFT_ALERT_PERMILLE_MAX, &config->driftAlertPermille, &rejected);
+
+  int32_t driftWindowLitres;
+  if (readConfigInt(json, "driftWindowLitres", 1, DRIFT_WINDOW_LITRES_MAX, &driftWindowLitres, &rejected))
+  {
+    config->driftWindowMls = driftWindowLitres * 1000UL;
+  }
+
+  float minPulseFrequency;
+  if (readConfigFloat(json, "minPulseFrequency", MIN_PULSE_FREQUENCY_MIN, MIN_PULSE_FREQUENCY_MAX, &minPulseFrequency, &rejected))
+  {
+    config->zeroFlowTimeoutMs = constrainValue((uint32_t)(ZERO_FLOW_TIMEOUT_PERIODS * 1000 / minPulseFrequency), ZERO_FLOW_TIMEOUT_MS_MIN, ZERO_FLOW_TIMEOUT_MS_MAX);
+  }
+
+  float frequencyScale;
+  if (readConfigFloat(json, "frequencyScale", 0, FREQUENCY_SCALE_MAX, &frequencyScale, &rejected))
+  {
+    config->frequencyScaleQ16 = (int64_t)(frequencyScale * 65536);
+  }
+
+  float frequencyOffsetHz;
+  if (readConfigFloat(json, "frequencyOffsetHz", 0, FREQUENCY_OFFSET_HZ_MAX, &frequencyOffsetHz, &rejected))
+  {
+    config->frequencyOffsetMhz = (uint32_t)(frequencyOffsetHz * 1000);
+  }
+
+  if (json.containsKey("inputMode"))
+  {
+    const char * mode = json["inputMode"];
+    if (mode && strcmp(mode, "pulse") == 0)
+    {
+      config->inputMode = INPUT_MODE_PULSE;
+    }
+    else if (mode && strcmp(mode, "quadrature") == 0)
+    {
+      config->inputMode = INPUT_MODE_QUADRATURE;
+    }
+    else if (mode && strcmp(mode, "frequency") == 0)
+    {
+      config->inputMode = INPUT_MODE_FREQUENCY;
+    }
+    else
+    {
+      rejected++;
+    }
+  }
+
+  readConfigString(json, "timezone", DEFAULT_TIMEZONE, config->posixTimezone, sizeof(config->posixTimezone), &rejected);
+  readConfigString(json, "ntpServer", DEFAULT_NTP_SERVER, config->ntpServer, sizeof(config->ntpServer), &rejected);
+
+  if (json.containsKey("tariffBands") && !parseTariffBands(json["tariffBands"], config))
+  {
+    rejected++;
+  }
+
+  return rejected;
+}
+
+/*--------------------------- Output config ---------------------------*/
+inline bool parseTelemetryFields(JsonVariant json, uint32_t * fieldMask)
+{
+  if (!json.is<JsonArray>())
+    return false;
+
+  // Any unknown key rejects the whole list, leaving the current fields alone
+  uint32_t mask = 0L;
+  for (JsonVariant item : json.as<JsonArray>())
+  {
+    const char * key = item.as<const char *>();
+    uint8_t field = 0;
+    while (key && field < FIELD_COUNT && strcmp(key, FIELD_KEYS[field][0]) != 0)
+    {
+      field++;
+    }
+
+    if (!key || field == FIELD_COUNT)
+      return false;
+
+    mask |= 1UL << field;
+  }
+
+  *fieldMask = mask;
+  return true;
+}
+
+inline uint8_t parseOutputConfig(JsonVariant json, uint32_t * fieldMask, bool * envelopeMode, bool * shortKeys)
+{
+  // As for the measurement config, returning how many values were rejected
+  uint8_t rejected = 0;
+
+  readConfigBool(json, "envelopeMode", envelopeMode, &rejected);
+  readConfigBool(json, "shortKeys", shortKeys, &rejected);
+
+  if (json.containsKey("telemetryFields") && !parseTelemetryFields(json["telemetryFields"], fieldMask))
+  {
+    rejected++;
+  }
+
+  return rejected;
+}
+
+#endif
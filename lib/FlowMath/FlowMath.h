@@ -0,0 +1,497 @@
+/**
+  Flow sensor measurement maths for the Open eXtensible Rack System
+
+  Arduino-free (header only) so the same code runs in the firmware and in
+  the native unit tests and fuzz target, see platformio.ini
+
+  GitHub repository:
+    https://github.com/sumnerboy12/OXRS-BJ-FlowSensor-ESP-FW
+
+  Copyright 2023 Ben Jones <ben.jones12@gmail.com>
+*/
+
+#ifndef FLOW_MATH_H
+#define FLOW_MATH_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Only needed on the device, where anything called from an ISR runs from IRAM
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+/*--------------------------- Constants -------------------------------*/
+// Config defaults and constraints
+#define   DEFAULT_TELEMETRY_INTERVAL_MS   1000
+#define   DEFAULT_K_FACTOR                49
+#define   TELEMETRY_INTERVAL_MS_MAX       60000
+#define   K_FACTOR_MAX                    1000
+#define   DEFAULT_RATE_FILTER_GAIN        25
+#define   RATE_FILTER_GAIN_MAX            100
+#define   DEFAULT_MIN_PULSE_FREQUENCY     2.0
+#define   MIN_PULSE_FREQUENCY_MIN         0.05
+#define   MIN_PULSE_FREQUENCY_MAX         1000.0
+
+// Number of minimum-frequency periods without a pulse before flow is stopped
+#define   ZERO_FLOW_TIMEOUT_PERIODS       2
+#define   ZERO_FLOW_TIMEOUT_MS_MIN        (uint32_t)(ZERO_FLOW_TIMEOUT_PERIODS * 1000 / MIN_PULSE_FREQUENCY_MAX)
+#define   ZERO_FLOW_TIMEOUT_MS_MAX        (uint32_t)(ZERO_FLOW_TIMEOUT_PERIODS * 1000 / MIN_PULSE_FREQUENCY_MIN)
+
+// Largest pulse count the volume reciprocal is exact for, i.e. 2^32 / K_FACTOR_MAX
+#define   VOLUME_RECIPROCAL_PULSES_MAX    4294967L
+
+// Local time (SNTP)
+#define   DEFAULT_TIMEZONE                "UTC0"
+#define   DEFAULT_NTP_SERVER              "pool.ntp.org"
+#define   TIMEZONE_MAX_LENGTH             48
+#define   NTP_SERVER_MAX_LENGTH           64
+
+// Time-of-use tariff bands (volume outside all bands goes to band 0)
+#define   TARIFF_BAND_MAX                 4
+#define   TARIFF_DAYS_WEEKDAY             0x01
+#define   TARIFF_DAYS_WEEKEND             0x02
+#define   TARIFF_DAYS_ALL                 (TARIFF_DAYS_WEEKDAY | TARIFF_DAYS_WEEKEND)
+#define   TARIFF_MINUTE_MAX               (24 * 60)
+
+// Input modes
+#define   INPUT_MODE_PULSE                0
+#define   INPUT_MODE_QUADRATURE           1
+#define   INPUT_MODE_FREQUENCY            2
+
+// Frequency-output meters (flow proportional to frequency)
+#define   DEFAULT_FREQUENCY_SCALE         1.0
+#define   FREQUENCY_SCALE_MAX             100000.0
+#define   FREQUENCY_OFFSET_HZ_MAX         10000.0
+
+// Reference meter K-factor drift estimation
+#define   DEFAULT_DRIFT_WINDOW_LITRES     1000
+#define   DRIFT_WINDOW_LITRES_MAX         100000
+#define   DEFAULT_DRIFT_ALERT_PERMILLE    20
+#define   DRIFT_ALERT_PERMILLE_MAX        500
+
+// Committed windows queued for publishing, once the queue is full adjacent
+// windows are merged to make room
+#define   BATCH_WINDOW_MAX                30
+
+// Pulse edge timestamp ring buffer (must be a power of 2, at most 128)
+#define   EDGE_BUFFER_SIZE                64
+#define   EDGE_BUFFER_MASK                (EDGE_BUFFER_SIZE - 1)
+
+/*--------------------------- Types -----------------------------------*/
+// Time-of-use tariff band, bands that end before they start run across midnight
+struct tariffBand
+{
+  uint8_t  days;
+  uint16_t startMinute;
+  uint16_t endMinute;
+};
+
+// Measurement config, so windows after a reboot use the right calibration
+// before the adoption service has pushed any config (persisted as is, so
+// append new fields, older records then read with them left at their defaults)
+struct configRecord
+{
+  uint32_t telemetryIntervalMs;
+  int32_t  kFactor;
+  uint32_t zeroFlowTimeoutMs;
+  int64_t  frequencyScaleQ16;
+  uint32_t frequencyOffsetMhz;
+  int32_t  referenceKFactor;
+  uint32_t driftWindowMls;
+  uint32_t driftAlertPermille;
+  uint8_t  rateFilterGain;
+  uint8_t  inputMode;
+
+  // Local time and tariff bands, so volume is billed to the right band
+  char     posixTimezone[TIMEZONE_MAX_LENGTH];
+  char     ntpServer[NTP_SERVER_MAX_LENGTH];
+  uint8_t  tariffBandCount;
+  tariffBand tariffBands[TARIFF_BAND_MAX];
+};
+
+// Everything measured for a single telemetry window (replayed across an
+// update, so new fields must only ever be appended)
+struct telemetryWindow
+{
+  // Raw counts snapshotted from the ISRs, removed once committed
+  uint32_t pulseCount;
+  uint32_t reversePulseCount;
+  uint32_t referencePulseCount;
+  uint32_t edgeMicros;
+  uint32_t edgeOverflowCount;
+
+  // Measurements (timestamp is epoch seconds, or 0 if not synced)
+  uint32_t boot;
+  uint32_t seq;
+  uint8_t  quality;
+  uint32_t timestamp;
+  uint32_t elapsedMs;
+  uint32_t volumeMls;
+  uint32_t reverseVolumeMls;
+  uint32_t referenceVolumeMls;
+  uint32_t frequencyMhz;
+  int32_t  rateMlsPerMin;
+  int32_t  rateChangeMlsPerMin;
+
+  // Running totals as of this window, filled in once it is committed
+  uint64_t totalVolumeMls;
+  uint64_t totalReverseVolumeMls;
+  uint8_t  tariffBand;
+  uint64_t tariffVolumeMls[TARIFF_BAND_MAX + 1];
+
+  // Seq of the first window merged into this one (seq itself if none were), 
+  // so a gap in seq downstream always means windows were lost
+  uint32_t firstSeq;
+};
+
+// Running totals, whole litres are folded into the base volume as windows 
+// are committed so only a remainder of less than kFactor pulses is kept
+struct flowTotals
+{
+  uint64_t baseVolumeMls;
+  uint32_t pulseCount;
+  uint64_t reverseBaseVolumeMls;
+  uint32_t reversePulseCount;
+
+  // Time-of-use totals (index 0 is outside all bands)
+  uint64_t tariffVolumeMls[TARIFF_BAND_MAX + 1];
+};
+
+// Committed windows waiting to be published, oldest first
+struct telemetryQueue
+{
+  telemetryWindow windows[BATCH_WINDOW_MAX];
+  uint8_t  count;
+};
+
+// Pulse edge timestamps, written by the ISR and drained in the main loop,
+// edges the ISR could only count (buffer full) are counted as overflows
+struct edgeRing
+{
+  volatile uint32_t timestamps[EDGE_BUFFER_SIZE];
+  volatile uint8_t  head;
+  volatile uint8_t  tail;
+  volatile uint32_t overflowCount;
+};
+
+// Pulse activity for zero-flow detection, edges the ring had to drop are
+// untimed so count as activity from when the overflow was noticed
+struct edgeActivity
+{
+  uint32_t activityMicros;
+  uint32_t overflowCount;
+};
+
+/*--------------------------- Volume ----------------------------------*/
+inline uint64_t getVolumeReciprocal(int32_t factor)
+{
+  // Precompute ceil(1000 * 2^32 / factor) so converting pulses to mL is a
+  // multiply and shift, the ESP8266 has no hardware divider
+  return ((1000ULL << 32) + factor - 1) / factor;
+}
+
+inline uint32_t pulsesToMls(uint32_t pulses, uint64_t reciprocal, int32_t factor)
+{
+  // The reciprocal is exact up to this count, beyond it just divide
+  if (pulses > VOLUME_RECIPROCAL_PULSES_MAX)
+    return (uint32_t)((uint64_t)pulses * 1000 / factor);
+
+  return (uint32_t)((pulses * reciprocal) >> 32);
+}
+
+inline void foldTotal(uint64_t * baseVolumeMls, uint32_t * pulses, uint64_t reciprocal, int32_t factor)
+{
+  // Move any whole litres into the base, floor(floor(1000n / k) / 1000) is
+  // floor(n / k) so this is exact, and dividing by a constant is cheap
+  uint32_t litres = pulsesToMls(*pulses, reciprocal, factor) / 1000;
+  *baseVolumeMls += litres * 1000ULL;
+  *pulses -= litres * factor;
+}
+
+/*--------------------------- Totals ----------------------------------*/
+inline uint64_t getTotalVolumeMls(const flowTotals * totals, uint64_t reciprocal, int32_t factor)
+{
+  return totals->baseVolumeMls + pulsesToMls(totals->pulseCount, reciprocal, factor);
+}
+
+inline uint64_t getTotalReverseVolumeMls(const flowTotals * totals, uint64_t reciprocal, int32_t factor)
+{
+  return totals->reverseBaseVolumeMls + pulsesToMls(totals->reversePulseCount, reciprocal, factor);
+}
+
+inline void bankTotals(flowTotals * totals, uint64_t reciprocal, int32_t factor)
+{
+  // Convert what is left with the current k-factor, before it changes
+  totals->baseVolumeMls = getTotalVolumeMls(totals, reciprocal, factor);
+  totals->pulseCount = 0L;
+  totals->reverseBaseVolumeMls = getTotalReverseVolumeMls(totals, reciprocal, factor);
+  totals->reversePulseCount = 0L;
+}
+
+inline uint64_t commitTotals(flowTotals * totals, telemetryWindow * window, bool frequencyMode, uint64_t reciprocal, int32_t factor)
+{
+  // Add a closed window to the totals, returning the volume it added, 
+  // frequency meters measure volume directly rather than counting pulses
+  uint64_t previousVolumeMls = getTotalVolumeMls(totals, reciprocal, factor);
+  if (frequencyMode)
+  {
+    totals->baseVolumeMls += window->volumeMls;
+  }
+  else
+  {
+    totals->pulseCount += window->pulseCount;
+    foldTotal(&totals->baseVolumeMls, &totals->pulseCount, reciprocal, factor);
+  }
+  totals->reversePulseCount += window->reversePulseCount;
+  foldTotal(&totals->reverseBaseVolumeMls, &totals->reversePulseCount, reciprocal, factor);
+
+  // Billed to the band it was measured in, whenever it is sent
+  uint64_t windowVolumeMls = getTotalVolumeMls(totals, reciprocal, factor) - previousVolumeMls;
+  totals->tariffVolumeMls[window->tariffBand] += windowVolumeMls;
+
+  window->totalVolumeMls = getTotalVolumeMls(totals, reciprocal, factor);
+  window->totalReverseVolumeMls = getTotalReverseVolumeMls(totals, reciprocal, factor);
+  memcpy(window->tariffVolumeMls, totals->tariffVolumeMls, sizeof(totals->tariffVolumeMls));
+
+  return windowVolumeMls;
+}
+
+/*--------------------------- Windows ---------------------------------*/
+inline uint32_t frequencyToMlsPerMin(uint32_t frequencyMhz, uint32_t offsetMhz, int64_t scaleQ16)
+{
+  if (frequencyMhz <= offsetMhz || scaleQ16 <= 0)
+    return 0L;
+
+  // Scale is mL/min per Hz, in Q16, multiplied a half at a time as the full
+  // product can overflow 64 bits (dropping the fraction first is still exact)
+  uint64_t frequency = frequencyMhz - offsetMhz;
+  uint64_t rate = frequency * (uint64_t)(scaleQ16 >> 16) + ((frequency * (uint64_t)(scaleQ16 & 0xFFFF)) >> 16);
+  rate /= 1000;
+  return rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate;
+}
+
+inline uint32_t rateToVolumeMls(uint32_t rateMlsPerMin, uint32_t elapsedMs)
+{
+  uint64_t volume = (uint64_t)rateMlsPerMin * elapsedMs / 60000;
+  return volume > UINT32_MAX ? UINT32_MAX : (uint32_t)volume;
+}
+
+inline uint32_t addSaturated(uint32_t a, uint32_t b)
+{
+  return a > UINT32_MAX - b ? UINT32_MAX : a + b;
+}
+
+inline void mergeWindow(telemetryWindow * earlier, const telemetryWindow * later)
+{
+  // Counts and volumes add up (saturating, a long outage can merge more than
+  // 4m3 into one window, the totals are still exact), rates are weighted by
+  // how long each window was open, and everything else (seq, timestamp,
+  // totals) is as of the later, apart from the first seq it covers
+  telemetryWindow merged = *later;
+  merged.firstSeq = earlier->firstSeq;
+  uint64_t elapsedMs = (uint64_t)earlier->elapsedMs + later->elapsedMs;
+  merged.elapsedMs = elapsedMs > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsedMs;
+  elapsedMs = elapsedMs > 0 ? elapsedMs : 1;
+
+  merged.pulseCount = addSaturated(merged.pulseCount, earlier->pulseCount);
+  merged.reversePulseCount = addSaturated(merged.reversePulseCount, earlier->reversePulseCount);
+  merged.referencePulseCount = addSaturated(merged.referencePulseCount, earlier->referencePulseCount);
+  merged.edgeOverflowCount = addSaturated(merged.edgeOverflowCount, earlier->edgeOverflowCount);
+  merged.quality |= earlier->quality;
+  merged.volumeMls = addSaturated(merged.volumeMls, earlier->volumeMls);
+  merged.reverseVolumeMls = addSaturated(merged.reverseVolumeMls, earlier->reverseVolumeMls);
+  merged.referenceVolumeMls = addSaturated(merged.referenceVolumeMls, earlier->referenceVolumeMls);
+  merged.frequencyMhz = ((uint64_t)earlier->frequencyMhz * earlier->elapsedMs + (uint64_t)later->frequencyMhz * later->elapsedMs) / elapsedMs;
+  merged.rateMlsPerMin = ((int64_t)earlier->rateMlsPerMin * earlier->elapsedMs + (int64_t)later->rateMlsPerMin * later->elapsedMs) / (int64_t)elapsedMs;
+
+  *earlier = merged;
+}
+
+/*--------------------------- Queue -----------------------------------*/
+inline void dequeueWindows(telemetryQueue * queue, uint8_t count)
+{
+  queue->count -= count;
+  memmove(&queue->windows[0], &queue->windows[count], sizeof(telemetryWindow) * queue->count);
+}
+
+inline uint8_t mergeWindows(telemetryQueue * queue)
+{
+  // Merge adjacent pairs, halving the resolution of what is queued rather
+  // than losing any of it, but never across a boot (sent once per message),
+  // returning how many pairs were merged
+  uint8_t count = 0;
+  uint8_t merged = 0;
+  for (uint8_t i = 0; i < queue->count; i++)
+  {
+    queue->windows[count] = queue->windows[i];
+    if (i + 1 < queue->count && queue->windows[i + 1].boot == queue->windows[i].boot)
+    {
+      mergeWindow(&queue->windows[count], &queue->windows[++i]);
+      merged++;
+    }
+    count++;
+  }
+  queue->count = count;
+
+  // Only possible if every window is from a different boot
+  if (queue->count >= BATCH_WINDOW_MAX)
+  {
+    dequeueWindows(queue, 1);
+  }
+
+  return merged;
+}
+
+inline uint8_t queueWindow(telemetryQueue * queue, const telemetryWindow * window)
+{
+  // Make room once full, returning how many pairs had to be merged
+  uint8_t merged = queue->count >= BATCH_WINDOW_MAX ? mergeWindows(queue) : 0;
+  queue->windows[queue->count++] = *window;
+  return merged;
+}
+
+inline uint8_t getAckedWindowCount(const telemetryQueue * queue, uint32_t boot, uint32_t seq)
+{
+  // Acks are cumulative, every window from that boot up to and including 
+  // that seq has been received (a merged window only once all of it has), 
+  // returning how many of the oldest windows that covers
+  uint8_t count = 0;
+  while (count < queue->count && queue->windows[count].boot == boot && queue->windows[count].seq <= seq)
+  {
+    count++;
+  }
+  return count;
+}
+
+/*--------------------------- Edges -----------------------------------*/
+inline void IRAM_ATTR pushEdge(edgeRing * ring, uint32_t now)
+{
+  // Timestamp this edge unless the main loop has fallen behind
+  uint8_t head = ring->head;
+  if ((uint8_t)(head - ring->tail) < EDGE_BUFFER_SIZE)
+  {
+    ring->timestamps[head & EDGE_BUFFER_MASK] = now;
+    ring->head = head + 1;
+  }
+  else
+  {
+    // Main loop has stalled, keep counting but lose the timing
+    ring->overflowCount++;
+  }
+}
+
+inline uint8_t peekEdges(edgeRing * ring, uint8_t * tail)
+{
+  // Snapshot the head, the ISR may keep writing beyond it while we work,
+  // the edges from tail up to it stay put until they are released
+  *tail = ring->tail;
+  return ring->head;
+}
+
+inline uint32_t getEdge(edgeRing * ring, uint8_t index)
+{
+  return ring->timestamps[index & EDGE_BUFFER_MASK];
+}
+
+inline void releaseEdges(edgeRing * ring, uint8_t head)
+{
+  ring->tail = head;
+}
+
+inline void resetEdgeActivity(edgeActivity * activity, const edgeRing * ring, uint32_t nowMicros)
+{
+  activity->activityMicros = nowMicros;
+  activity->overflowCount = ring->overflowCount;
+}
+
+inline uint32_t getEdgeIdleMs(edgeActivity * activity, const edgeRing * ring, uint32_t lastEdgeMicros, uint32_t nowMicros)
+{
+  // After a stall the newest timed edge can be seconds old, but a rising
+  // overflow count means pulses kept arriving
+  uint32_t overflowCount = ring->overflowCount;
+  if (overflowCount != activity->overflowCount)
+  {
+    activity->activityMicros = nowMicros;
+    activity->overflowCount = overflowCount;
+  }
+
+  // Whichever is newer, checked every loop so both are recent enough to
+  // compare across the timer wrapping
+  if ((int32_t)(lastEdgeMicros - activity->activityMicros) > 0)
+  {
+    activity->activityMicros = lastEdgeMicros;
+  }
+
+  return (nowMicros - activity->activityMicros) / 1000;
+}
+
+/*--------------------------- Config ----------------------------------*/
+template <typename T>
+inline T constrainValue(T value, T low, T high)
+{
+  return value < low ? low : (value > high ? high : value);
+}
+
+inline void getDefaultConfigRecord(configRecord * record)
+{
+  // Zero any padding so records compare (and CRC) consistently
+  memset(record, 0, sizeof(configRecord));
+
+  record->telemetryIntervalMs = DEFAULT_TELEMETRY_INTERVAL_MS;
+  record->kFactor = DEFAULT_K_FACTOR;
+  record->zeroFlowTimeoutMs = (uint32_t)(ZERO_FLOW_TIMEOUT_PERIODS * 1000 / DEFAULT_MIN_PULSE_FREQUENCY);
+  record->frequencyScaleQ16 = (int64_t)(DEFAULT_FREQUENCY_SCALE * 65536);
+  record->driftWindowMls = DEFAULT_DRIFT_WINDOW_LITRES * 1000UL;
+  record->driftAlertPermille = DEFAULT_DRIFT_ALERT_PERMILLE;
+  record->rateFilterGain = DEFAULT_RATE_FILTER_GAIN;
+  record->inputMode = INPUT_MODE_PULSE;
+  strcpy(record->posixTimezone, DEFAULT_TIMEZONE);
+  strcpy(record->ntpServer, DEFAULT_NTP_SERVER);
+}
+
+inline void constrainConfigRecord(configRecord * record)
+{
+  // Clamp every field to its limits, e.g. for a record saved by an older
+  // image (or a buggy one), so nothing downstream can divide by zero
+  record->telemetryIntervalMs = constrainValue(record->telemetryIntervalMs, (uint32_t)1, (uint32_t)TELEMETRY_INTERVAL_MS_MAX);
+  record->kFactor = constrainValue(record->kFactor, (int32_t)1, (int32_t)K_FACTOR_MAX);
+  record->zeroFlowTimeoutMs = constrainValue(record->zeroFlowTimeoutMs, ZERO_FLOW_TIMEOUT_MS_MIN, ZERO_FLOW_TIMEOUT_MS_MAX);
+  record->frequencyScaleQ16 = constrainValue(record->frequencyScaleQ16, (int64_t)0, (int64_t)(FREQUENCY_SCALE_MAX * 65536));
+  record->frequencyOffsetMhz = constrainValue(record->frequencyOffsetMhz, (uint32_t)0, (uint32_t)(FREQUENCY_OFFSET_HZ_MAX * 1000));
+  record->referenceKFactor = constrainValue(record->referenceKFactor, (int32_t)0, (int32_t)K_FACTOR_MAX);
+  record->driftWindowMls = constrainValue(record->driftWindowMls, (uint32_t)1000, (uint32_t)DRIFT_WINDOW_LITRES_MAX * 1000);
+  record->driftAlertPermille = constrainValue(record->driftAlertPermille, (uint32_t)1, (uint32_t)DRIFT_ALERT_PERMILLE_MAX);
+  record->rateFilterGain = constrainValue(record->rateFilterGain, (uint8_t)1, (uint8_t)RATE_FILTER_GAIN_MAX);
+
+  if (record->inputMode > INPUT_MODE_FREQUENCY)
+  {
+    record->inputMode = INPUT_MODE_PULSE;
+  }
+
+  // Strings are always terminated when saved, but make sure
+  record->posixTimezone[TIMEZONE_MAX_LENGTH - 1] = 0;
+  record->ntpServer[NTP_SERVER_MAX_LENGTH - 1] = 0;
+  if (record->posixTimezone[0] == 0)
+  {
+    strcpy(record->posixTimezone, DEFAULT_TIMEZONE);
+  }
+  if (record->ntpServer[0] == 0)
+  {
+    strcpy(record->ntpServer, DEFAULT_NTP_SERVER);
+  }
+
+  if (record->tariffBandCount > TARIFF_BAND_MAX)
+  {
+    record->tariffBandCount = TARIFF_BAND_MAX;
+  }
+  for (uint8_t i = 0; i < record->tariffBandCount; i++)
+  {
+    tariffBand * band = &record->tariffBands[i];
+    band->days = (band->days & TARIFF_DAYS_ALL) ? band->days & TARIFF_DAYS_ALL : TARIFF_DAYS_ALL;
+    band->startMinute = constrainValue(band->startMinute, (uint16_t)0, (uint16_t)TARIFF_MINUTE_MAX);
+    band->endMinute = constrainValue(band->endMinute, (uint16_t)0, (uint16_t)TARIFF_MINUTE_MAX);
+  }
+}
+
+#endif
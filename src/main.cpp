@@ -10,6 +10,10 @@
 /*--------------------------- Libraries -------------------------------*/
 #include <Arduino.h>
 #include <OXRS_HASS.h>
+#include <LittleFS.h>
+#include <Updater.h>
+#include <time.h>
+#include <FlowConfig.h>
 
 #if defined(OXRS_ROOM8266)
 #include <OXRS_Room8266.h>
@@ -20,75 +24,2722 @@ OXRS_Room8266 oxrs;
 // Serial
 #define   SERIAL_BAUD_RATE                115200
 
-// Config defaults and constraints
-#define   DEFAULT_TELEMETRY_INTERVAL_MS   1000
-#define   DEFAULT_K_FACTOR                49
-#define   TELEMETRY_INTERVAL_MS_MAX       60000
-#define   K_FACTOR_MAX                    1000
+// Measurement config defaults and constraints, input modes and the edge
+// ring buffer are in FlowMath.h, shared with the native tests
+
+// Clock is treated as synced (SNTP) once it is past this
+#define   TIME_VALID_EPOCH                1672531200L
+
+// Persisted totals
+#define   TOTALS_FILE                     "/totals.bin"
+#define   TOTALS_SAVE_INTERVAL_MS         900000L
+
+// Running totals, published as a retained last value for new subscribers
+#define   TOTALS_PUBLISH_INTERVAL_MS      60000L
+
+// Persisted measurement config, applied at boot before any MQTT config
+#define   CONFIG_FILE                     "/config.bin"
+
+// State carried across an OTA update, queued windows go to flash and any
+// pulses counted while the new image is written go to RTC memory
+#define   REPLAY_FILE                     "/replay.bin"
+#define   UPDATE_CARRY_RTC_BLOCK          0
+#define   UPDATE_CARRY_RTC_WORDS          16
+
+// Persisted records start with a header giving the size of each record
+#define   RECORD_MAGIC                    0x5846
+#define   RECORD_SKIP_BUFFER_SIZE         32
+
+// Learned hour-of-week baseline, an EWMA of each hour's volume and of its
+// mean absolute deviation (weighting each new hour 1/2^shift)
+#define   BASELINE_FILE                   "/baseline.bin"
+#define   BASELINE_HOURS                  168
+#define   BASELINE_SHIFT                  3
+#define   BASELINE_MIN_SAMPLES            3
+#define   BASELINE_MIN_SIGMA_MLS          1000L
+#define   BASELINE_HOUR_UNKNOWN           0xFF
+#define   ANOMALY_SIGMA_MAX               10
+
+// Per-minute volume history, a circular log of fixed size blocks on flash
+// each holding delta + zigzag varint encoded (minute, volume) entries, the
+// block header is 16 bytes and an entry at most two 5 byte varints, each
+// block is its own file so rewriting one never moves the others
+#define   HISTORY_DIR                     "/history"
+#define   HISTORY_PATH_MAX_LENGTH         20
+#define   HISTORY_BLOCK_SIZE              512
+#define   HISTORY_BLOCKS                  256
+#define   HISTORY_PAYLOAD_SIZE            (HISTORY_BLOCK_SIZE - 16)
+#define   HISTORY_ENTRY_MAX_BYTES         10
+#define   HISTORY_QUERY_ROWS_MAX          100
+
+// Daily/weekly/monthly consumption
+#define   CONSUMPTION_PUBLISH_INTERVAL_MS 60000L
+#define   PERIOD_CHECK_INTERVAL_MS        1000L
+
+// Quadrature mode uses the reference pin for phase B
+#define   QUADRATURE_PIN_A                I2C_SDA
+#define   QUADRATURE_PIN_B                I2C_SCL
+#define   QUADRATURE_STEPS_PER_PULSE      4
+
+// Frequency (mHz) of a 1us period in Q4, i.e. 10^9 * 16
+#define   PERIOD_Q4_MHZ                   16000000000ULL
+
+// Reference meter (e.g. a sub-meter in series) for K-factor drift estimation
+#define   REFERENCE_PIN                   I2C_SCL
+#define   DRIFT_RATIO_ONE_Q16             65536L
+#define   DRIFT_SMOOTHING_SHIFT           2
+
+// Inter-pulse interval histogram, log2 buckets from 2^7us (~128us) up,
+// the first bucket also holds anything faster and the last anything slower
+#define   HISTOGRAM_BUCKETS               16
+#define   HISTOGRAM_BASE_BIT              7
+#define   HISTOGRAM_INTERVAL_MINS_MAX     1440
+
+// Flight recorder, fine-grained rate samples either side of a trigger (the
+// sample buffer must be a power of 2), published as packed uint16s
+#define   CAPTURE_SAMPLE_MS               50
+#define   CAPTURE_SAMPLES                 128
+#define   CAPTURE_SAMPLES_MASK            (CAPTURE_SAMPLES - 1)
+#define   CAPTURE_PRE_SAMPLES             64
+#define   CAPTURE_STEP_SAMPLES            4
+#define   CAPTURE_RATE_UNIT_MLS           10
+#define   CAPTURE_RATE_STEP_MAX           1000000
+#define   CAPTURE_BASE64_LENGTH           ((CAPTURE_SAMPLES * 2 + 2) / 3 * 4 + 1)
+
+// Per-window data quality flags
+#define   QUALITY_PARTIAL                 0x01
+#define   QUALITY_CONFIG_CHANGED          0x02
+#define   QUALITY_GLITCHES                0x04
+#define   QUALITY_OVERFLOW                0x08
+#define   QUALITY_CLOCK_UNSYNCED          0x10
+#define   QUALITY_REPLAYED                0x20
+#define   QUALITY_UPDATED                 0x40
+
+// Any pulse interval shorter than this is counted as a glitch (pulse/quadrature modes)
+#define   GLITCH_INTERVAL_US              500
+
+// Batched uploads, windows are queued in RAM and published together (see
+// BATCH_WINDOW_MAX)
+#define   BATCH_INTERVAL_MINS_MAX         1440
+
+// Acknowledged delivery, windows stay queued until the consumer acks their
+// (boot, seq) on the command topic, with at most this many sent but unacked
+#define   ACK_TIMEOUT_SECS_MAX            3600
+#define   ACK_WINDOW_MAX                  8
+
+// Batch document, sized for a full queue with every window field selected
+// (a fields list and a row per window), plus the message fields and the
+// tariff band totals
+#define   BATCH_ROW_JSON_SIZE             JSON_ARRAY_SIZE(FIELD_MESSAGE_FIRST)
+#define   BATCH_JSON_SIZE                 (JSON_OBJECT_SIZE(FIELD_COUNT - FIELD_MESSAGE_FIRST + 3) + \
+                                           BATCH_ROW_JSON_SIZE + JSON_ARRAY_SIZE(BATCH_WINDOW_MAX) + \
+                                           BATCH_WINDOW_MAX * BATCH_ROW_JSON_SIZE + \
+                                           JSON_ARRAY_SIZE(TARIFF_BAND_MAX + 1))
+
+// Cached MQTT topics, built once on (re)configuration
+#define   TOPIC_TELEMETRY                 0
+#define   TOPIC_STATUS                    1
+#define   TOPIC_CONSUMPTION               2
+#define   TOPIC_HISTOGRAM                 3
+#define   TOPIC_BATCH                     4
+#define   TOPIC_ENVELOPE                  5
+#define   TOPIC_CAPTURE                   6
+#define   TOPIC_ANOMALY                   7
+#define   TOPIC_HISTORY                   8
+#define   TOPIC_TOTALS                    9
+#define   TOPIC_DRIFT                     10
+#define   TOPIC_COUNT                     11
+#define   TOPIC_MAX_LENGTH                64
+
+// Outputs which can be coalesced into a single envelope message per loop pass
+#define   OUTPUT_FLOW_EVENT               0
+#define   OUTPUT_DRIFT_EVENT              1
+#define   OUTPUT_HISTOGRAM                2
+#define   OUTPUT_CONSUMPTION              3
+#define   OUTPUT_BATCH                    4
+#define   OUTPUT_CAPTURE                  5
+#define   OUTPUT_ANOMALY                  6
+#define   OUTPUT_TOTALS                   7
+#define   OUTPUT_TELEMETRY                8
+#define   OUTPUT_COUNT                    9
+
+// Envelope, sized to hold a full batch alongside every other output (none 
+// of which needs more than 2KB between them), so no output can be left 
+// waiting on an envelope it will never fit in
+#define   ENVELOPE_OTHER_JSON_SIZE        2048
+#define   ENVELOPE_JSON_SIZE              (JSON_OBJECT_SIZE(OUTPUT_COUNT) + BATCH_JSON_SIZE + ENVELOPE_OTHER_JSON_SIZE)
+
+// How often to verify pulse conservation (debug builds only)
+#define   PULSE_CHECK_INTERVAL_MS         10000
 
 /*--------------------------- Global Variables ------------------------*/
-// Config variables
-uint32_t  telemetryIntervalMs           = DEFAULT_TELEMETRY_INTERVAL_MS;
-int       kFactor                       = DEFAULT_K_FACTOR;
+// Config variables, the measurement config is set from the defaults (or
+// the saved config) in loadConfig(), see getDefaultConfigRecord()
+uint32_t  telemetryIntervalMs           = 0L;
+int       kFactor                       = 0;
+uint8_t   rateFilterGain                = 0;
+uint64_t  volumeReciprocal              = 0LL;
+uint32_t  zeroFlowTimeoutMs             = 0L;
+bool      envelopeMode                  = false;
+uint32_t  histogramIntervalMs           = 0L;
+uint32_t  captureRateStepMlsPerMin      = 0L;
+uint8_t   anomalySigma                  = 0;
+uint32_t  batchIntervalMs               = 0L;
+uint8_t   inputMode                     = INPUT_MODE_PULSE;
+int64_t   frequencyScaleQ16             = 0LL;
+uint32_t  frequencyOffsetMhz            = 0L;
+int       referenceKFactor              = 0;
+uint64_t  referenceReciprocal           = 0LL;
+uint32_t  driftWindowMls                = 0L;
+uint32_t  driftAlertPermille            = 0L;
+
+// Pulse count/telemetry variables
+volatile uint32_t pulseCount            = 0L;
+uint32_t  lastTelemetryMs               = 0L;
+uint32_t  elapsedTelemetryMs            = 0L;
+uint32_t  telemetryPublishFailures      = 0L;
+uint32_t  lastPublishFailureMs          = 0L;
+bool      publishFailed                 = false;
+
+// Window sequence number, restarts each boot so (boot, seq) is unique
+uint32_t  bootCount                     = 0L;
+uint32_t  windowSeq                     = 0L;
+
+// Quality flags raised during the current window (first window is partial)
+uint8_t   windowQuality                 = QUALITY_PARTIAL;
+
+// Selected telemetry fields, resolved into a list on (re)configuration
+uint32_t  telemetryFieldMask            = DEFAULT_TELEMETRY_FIELD_MASK;
+bool      shortKeys                     = false;
+uint8_t   telemetryFieldList[FIELD_COUNT];
+uint8_t   telemetryFieldCount           = 0;
+
+// Committed windows waiting to be published, oldest first, either one at
+// a time or together in the next batch upload
+telemetryQueue windowQueue;
+uint8_t   batchWindowCount              = 0;
+uint32_t  lastBatchMs                   = 0L;
+uint32_t  mergedWindowCount             = 0L;
+
+// Acknowledged delivery (if enabled), the oldest sentWindowCount queued 
+// windows have gone out and are waiting for an ack, all of them are sent 
+// again if none arrives in time
+uint32_t  ackTimeoutMs                  = 0L;
+uint8_t   sentWindowCount               = 0;
+uint32_t  lastAckMs                     = 0L;
+uint32_t  windowResends                 = 0L;
+
+// Running totals, forward and reverse, and per tariff band
+flowTotals totals;
+bool      totalsPublishDirty            = true;
+uint32_t  lastTotalsPublishMs           = 0L;
+
+// Quadrature decoder state, forward cycles count as normal pulses
+volatile uint8_t  quadratureState       = 0;
+volatile int8_t   quadratureStep        = 0;
+volatile bool     reverseFlow           = false;
+volatile uint32_t reversePulseCount     = 0L;
+
+// Frequency mode reciprocal counting, the time of the last edge in each 
+// window is the reference for measuring the next window's edges against
+volatile uint32_t frequencyEdgeMicros   = 0L;
+uint32_t  frequencyRefMicros            = 0L;
+bool      frequencyRefValid             = false;
+
+// Step for each (previous << 2 | current) phase state, +1 is forward
+const int8_t QUADRATURE_TABLE[16] = { 0, 1, -1, 0, -1, 0, 0, 1, 1, 0, 0, -1, 0, -1, 1, 0 };
+
+#if defined(PULSE_CONSERVATION_CHECK)
+// Independent shadow count from the ISR vs what we have published
+volatile uint32_t shadowPulseCount      = 0L;
+uint32_t  publishedPulseCount           = 0L;
+uint32_t  lastPulseCheckMs              = 0L;
+#endif
+
+// Pulse edge timestamps, overflows are edges the rate tracker still needs
+// to account for in its next batch
+edgeRing  edgeBuffer;
+uint32_t  lastEdgeOverflowCount         = 0L;
+uint32_t  droppedEdges                  = 0L;
+uint32_t  windowOverflowBase            = 0L;
+edgeActivity zeroFlowActivity;
+
+// Alpha-beta rate tracker on the inter-pulse period (all Q8 gains, Q4 periods)
+int32_t   alphaQ8                       = 0;
+int32_t   betaQ8                        = 0;
+bool      ratePrimed                    = false;
+uint32_t  lastEdgeMicros                = 0L;
+int32_t   periodQ4                      = 0L;
+int32_t   periodSlopeQ4                 = 0L;
+
+// Reference meter pulses and long-horizon main/reference volume ratio
+volatile uint32_t referencePulseCount   = 0L;
+uint32_t  driftMainPulses               = 0L;
+uint32_t  driftReferencePulses          = 0L;
+int32_t   driftRatioQ16                 = 0L;
+bool      driftAlerted                  = false;
+bool      driftEventPending             = false;
+
+// Inter-pulse interval histogram
+uint32_t  intervalHistogram[HISTOGRAM_BUCKETS];
+uint32_t  lastHistogramMs               = 0L;
+
+// Flight recorder, sampling pauses once a capture is complete until it is sent
+uint16_t  captureSamples[CAPTURE_SAMPLES];
+uint8_t   captureHead                   = 0;
+uint8_t   captureCount                  = 0;
+uint8_t   capturePostRemaining          = 0;
+bool      capturePending                = false;
+bool      captureFlowing                = false;
+const char * captureTrigger             = NULL;
+uint32_t  lastCaptureSampleMs           = 0L;
+char      captureBase64[CAPTURE_BASE64_LENGTH];
+
+// Flow start/stop event state (published immediately, outside the telemetry window)
+bool      flowing                       = false;
+bool      flowEventPending              = false;
+uint32_t  flowStartedMs                 = 0L;
+uint32_t  flowDurationMs                = 0L;
+
+// Local time config (SNTP)
+char      posixTimezone[TIMEZONE_MAX_LENGTH];
+char      ntpServer[NTP_SERVER_MAX_LENGTH];
+
+// Time-of-use tariff bands (their totals are kept with the running totals)
+tariffBand tariffBands[TARIFF_BAND_MAX];
+uint8_t   tariffBandCount               = 0;
+
+// Totals persisted to flash, a new image may add fields but only at the
+// end, see readRecords()
+struct totalsRecord
+{
+  uint64_t volumeMls;
+  uint64_t tariffVolumeMls[TARIFF_BAND_MAX + 1];
+  uint64_t reverseVolumeMls;
+  uint64_t todayMls;
+  uint64_t yesterdayMls;
+  uint64_t weekMls;
+  uint64_t monthMls;
+  uint32_t periodDay;
+  uint32_t periodMonth;
+  int32_t  driftRatioQ16;
+  uint32_t bootCount;
+};
+
+// Consumption per local calendar period, rolled over at local midnight
+uint64_t  todayMls                      = 0LL;
+uint64_t  yesterdayMls                  = 0LL;
+uint64_t  weekMls                       = 0LL;
+uint64_t  monthMls                      = 0LL;
+uint32_t  periodDay                     = 0L;
+uint32_t  periodMonth                   = 0L;
+bool      consumptionDirty              = true;
+uint32_t  lastConsumptionMs             = 0L;
+uint32_t  lastPeriodCheckMs             = 0L;
+
+bool      totalsDirty                   = false;
+uint32_t  lastTotalsSaveMs              = 0L;
+
+// Hour-of-week baseline (Monday 00:00 is hour 0), persisted as it is learnt
+// (append only, like the other records)
+struct baselineRecord
+{
+  uint32_t meanMls[BASELINE_HOURS];
+  uint32_t deviationMls[BASELINE_HOURS];
+  uint8_t  samples[BASELINE_HOURS];
+};
+
+baselineRecord baseline;
+
+// Volume this hour, which is only learnt from if we saw all of it
+uint8_t   baselineHour                  = BASELINE_HOUR_UNKNOWN;
+bool      baselineHourPartial           = true;
+uint32_t  baselineHourMls               = 0L;
+
+// History blocks are written whole, once full, so each flash write covers
+// a couple of hours of entries
+struct historyBlock
+{
+  uint32_t crc;
+  uint32_t firstMinute;
+  uint32_t lastMinute;
+  uint16_t count;
+  uint16_t length;
+  uint8_t  payload[HISTORY_PAYLOAD_SIZE];
+};
+
+// Block being filled, and the first minute of each block on flash (0 if 
+// empty) so range queries only read the blocks they need
+historyBlock historyBuffer;
+uint32_t  historyIndex[HISTORY_BLOCKS];
+uint16_t  historyHead                   = 0;
+uint32_t  historyLastMinute             = 0L;
+uint32_t  historyLastVolumeMls          = 0L;
+
+// Volume this minute (epoch minutes, 0 until the clock has synced)
+uint32_t  historyMinute                 = 0L;
+uint32_t  historyMinuteMls              = 0L;
+
+// Last completed hour scored against the baseline, waiting to be published
+bool      anomalyPending                = false;
+uint8_t   anomalyHour                   = 0;
+uint32_t  anomalyVolumeMls              = 0L;
+uint32_t  anomalyBaselineMls            = 0L;
+uint32_t  anomalySigmaMls               = 0L;
+int32_t   anomalyScoreQ8                = 0L;
+
+// Last record written, so re-sent but unchanged config doesn't wear the flash
+configRecord savedConfig;
+
+// Pulses counted since the pre-update flush, kept in RTC memory which 
+// survives the restart at the end of an OTA update, the CRC covers the 
+// size and every field after it (which may only ever be appended to)
+struct updateCarryRecord
+{
+  uint32_t crc;
+  uint32_t size;
+  uint32_t bootCount;
+  uint32_t windowCount;
+  uint32_t pulseCount;
+  uint32_t reversePulseCount;
+  uint32_t referencePulseCount;
+};
+
+// Header written before each set of persisted records
+struct recordHeader
+{
+  uint16_t magic;
+  uint16_t count;
+  uint32_t size;
+};
+
+// Set once an OTA update has started and our state has been flushed
+bool      updateFlushed                 = false;
+
+// MQTT topic table, indexed by TOPIC_xxx
+char      topics[TOPIC_COUNT][TOPIC_MAX_LENGTH];
+
+// Envelope key and per-topic destination of each output, indexed by OUTPUT_xxx
+const char * const OUTPUT_KEYS[OUTPUT_COUNT] = { "flowEvent", "driftEvent", "histogram", "consumption", "batch", "capture", "anomaly", "totals", "telemetry" };
+const uint8_t OUTPUT_TOPICS[OUTPUT_COUNT] = { TOPIC_STATUS, TOPIC_DRIFT, TOPIC_HISTOGRAM, TOPIC_CONSUMPTION, TOPIC_BATCH, TOPIC_CAPTURE, TOPIC_ANOMALY, TOPIC_TOTALS, TOPIC_TELEMETRY };
+
+// Envelope for the current loop pass (allocated once, on the first output
+// in envelope mode, then cleared each pass so the heap isn't fragmented), 
+// and the outputs it holds, which are only marked as sent once it goes out
+DynamicJsonDocument * envelope          = NULL;
+uint16_t  envelopeOutputs               = 0;
+
+// Publish Home Assistant self-discovery config for each sensor
+bool      hassDiscoveryPublished        = false;
+
+/*--------------------------- Instantiate Globals ---------------------*/
+// home assistant discovery config
+OXRS_HASS hass(oxrs.getMQTT());
+
+/*--------------------------- Program ---------------------------------*/
+void IRAM_ATTR isr() 
+{
+  pulseCount++;
+
+#if defined(PULSE_CONSERVATION_CHECK)
+  shadowPulseCount++;
+#endif
+
+  pushEdge(&edgeBuffer, micros());
+}
+
+void IRAM_ATTR isrFrequency()
+{
+  // The count and last edge time measure each window, the edges are also 
+  // timed for flow start/stop and the rate between windows (up to ~10kHz 
+  // the buffer can fill between loop passes, which is fine in this mode)
+  uint32_t now = micros();
+  pulseCount++;
+  frequencyEdgeMicros = now;
+  pushEdge(&edgeBuffer, now);
+
+#if defined(PULSE_CONSERVATION_CHECK)
+  shadowPulseCount++;
+#endif
+}
+
+void IRAM_ATTR isrQuadrature()
+{
+  // Decode every phase transition, so bounce on one phase just steps back 
+  // and forth, and only count a pulse once a full cycle has been completed
+  uint8_t state = (digitalRead(QUADRATURE_PIN_A) << 1) | digitalRead(QUADRATURE_PIN_B);
+  quadratureStep += QUADRATURE_TABLE[(quadratureState << 2) | state];
+  quadratureState = state;
+
+  if (quadratureStep >= QUADRATURE_STEPS_PER_PULSE)
+  {
+    quadratureStep = 0;
+    reverseFlow = false;
+    isr();
+  }
+  else if (quadratureStep <= -QUADRATURE_STEPS_PER_PULSE)
+  {
+    quadratureStep = 0;
+    reverseFlow = true;
+    reversePulseCount++;
+    pushEdge(&edgeBuffer, micros());
+  }
+}
+
+void IRAM_ATTR isrReference()
+{
+  referencePulseCount++;
+}
+
+void setRateFilterGain(uint8_t gain)
+{
+  // Benedict-Bordner beta for the chosen alpha, i.e. a^2 / (2 - a)
+  rateFilterGain = gain;
+  alphaQ8 = ((int32_t)gain << 8) / 100;
+  betaQ8 = (alphaQ8 * alphaQ8) / (512 - alphaQ8);
+}
+
+void buildTopics()
+{
+  OXRS_MQTT * mqtt = oxrs.getMQTT();
+  mqtt->getTelemetryTopic(topics[TOPIC_TELEMETRY]);
+  mqtt->getStatusTopic(topics[TOPIC_STATUS]);
+
+  // Consumption is a retained sub-topic of telemetry
+  snprintf_P(topics[TOPIC_CONSUMPTION], TOPIC_MAX_LENGTH, PSTR("%s/consumption"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_HISTOGRAM], TOPIC_MAX_LENGTH, PSTR("%s/histogram"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_BATCH], TOPIC_MAX_LENGTH, PSTR("%s/batch"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_ENVELOPE], TOPIC_MAX_LENGTH, PSTR("%s/envelope"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_CAPTURE], TOPIC_MAX_LENGTH, PSTR("%s/capture"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_ANOMALY], TOPIC_MAX_LENGTH, PSTR("%s/anomaly"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_HISTORY], TOPIC_MAX_LENGTH, PSTR("%s/history"), topics[TOPIC_TELEMETRY]);
+  snprintf_P(topics[TOPIC_TOTALS], TOPIC_MAX_LENGTH, PSTR("%s/totals"), topics[TOPIC_TELEMETRY]);
+
+  // Drift alerts get their own status sub-topic, the status topic itself 
+  // carries the flow events the Flowing binary sensor is driven from
+  snprintf_P(topics[TOPIC_DRIFT], TOPIC_MAX_LENGTH, PSTR("%s/drift"), topics[TOPIC_STATUS]);
+}
+
+bool publishTopic(uint8_t index, JsonVariant json, bool retained)
+{
+  return oxrs.getMQTT()->publish(json, topics[index], retained);
+}
+
+uint32_t crc32(const uint8_t * data, size_t length, uint32_t crc = 0)
+{
+  // Pass the previous result to continue a CRC across several buffers
+  crc = ~crc;
+  while (length--)
+  {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void encodeBase64(const uint8_t * data, size_t length, char * output)
+{
+  static const char BASE64_CHARS[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  // Output must hold 4 chars for every 3 bytes (rounded up), plus the null
+  for (size_t i = 0; i < length; i += 3)
+  {
+    uint32_t block = (uint32_t)data[i] << 16;
+    if (i + 1 < length) block |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length) block |= data[i + 2];
+
+    *output++ = pgm_read_byte(&BASE64_CHARS[(block >> 18) & 0x3F]);
+    *output++ = pgm_read_byte(&BASE64_CHARS[(block >> 12) & 0x3F]);
+    *output++ = i + 1 < length ? pgm_read_byte(&BASE64_CHARS[(block >> 6) & 0x3F]) : '=';
+    *output++ = i + 2 < length ? pgm_read_byte(&BASE64_CHARS[block & 0x3F]) : '=';
+  }
+  *output = 0;
+}
+
+uint16_t readRecords(const char * path, void * records, size_t size, uint16_t maxCount)
+{
+  File file = LittleFS.open(path, "r");
+  if (!file)
+    return 0;
+
+  // Records are written with the size of each, so one written by another 
+  // image still reads as long as fields have only ever been appended, any 
+  // we don't know are skipped and any it didn't know keep the caller's 
+  // defaults
+  recordHeader header;
+  bool headed = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+    header.magic == RECORD_MAGIC && header.size > 0 &&
+    file.size() == sizeof(header) + (size_t)header.count * header.size + sizeof(uint32_t);
+
+  if (!headed || header.count > maxCount)
+  {
+    file.close();
+    return 0;
+  }
+
+  // Each set of records is followed by a CRC of them all, as written
+  uint32_t crc = 0;
+  bool valid = true;
+  for (uint16_t i = 0; i < header.count && valid; i++)
+  {
+    uint8_t * record = (uint8_t *)records + i * size;
+    size_t known = min((size_t)header.size, size);
+    valid = file.read(record, known) == known;
+    crc = crc32(record, known, crc);
+
+    for (size_t skip = header.size - known; skip > 0 && valid; )
+    {
+      uint8_t buffer[RECORD_SKIP_BUFFER_SIZE];
+      size_t length = min(skip, sizeof(buffer));
+      valid = file.read(buffer, length) == length;
+      crc = crc32(buffer, length, crc);
+      skip -= length;
+    }
+  }
+
+  uint32_t storedCrc = 0;
+  valid = valid && file.read((uint8_t *)&storedCrc, sizeof(storedCrc)) == sizeof(storedCrc) && storedCrc == crc;
+  file.close();
+
+  return valid ? header.count : 0;
+}
+
+bool readRecord(const char * path, void * record, size_t size)
+{
+  return readRecords(path, record, size, 1) == 1;
+}
+
+bool writeRecords(const char * path, void * records, size_t size, uint16_t count)
+{
+  File file = LittleFS.open(path, "w");
+  if (!file)
+    return false;
+
+  recordHeader header;
+  header.magic = RECORD_MAGIC;
+  header.count = count;
+  header.size = size;
+
+  uint32_t crc = crc32((uint8_t *)records, size * count);
+  bool written = file.write((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+    file.write((uint8_t *)records, size * count) == size * count &&
+    file.write((uint8_t *)&crc, sizeof(crc)) == sizeof(crc);
+  file.close();
+  return written;
+}
+
+bool writeRecord(const char * path, void * record, size_t size)
+{
+  return writeRecords(path, record, size, 1);
+}
+
+bool isTimeValid()
+{
+  return time(NULL) > TIME_VALID_EPOCH;
+}
+
+uint8_t getTariffBand()
+{
+  // Can't bucket by time of day until SNTP has synced
+  if (!isTimeValid())
+    return 0;
+
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+
+  uint8_t day = (local.tm_wday == 0 || local.tm_wday == 6) ? TARIFF_DAYS_WEEKEND : TARIFF_DAYS_WEEKDAY;
+  uint16_t minute = local.tm_hour * 60 + local.tm_min;
+
+  for (uint8_t i = 0; i < tariffBandCount; i++)
+  {
+    tariffBand * band = &tariffBands[i];
+    if (!(band->days & day))
+      continue;
+
+    // Bands that end before they start run across midnight
+    bool inBand = band->startMinute <= band->endMinute
+      ? minute >= band->startMinute && minute < band->endMinute
+      : minute >= band->startMinute || minute < band->endMinute;
+
+    if (inBand)
+      return i + 1;
+  }
+
+  return 0;
+}
+
+uint32_t getLocalDay(struct tm * local)
+{
+  // Days since 1970-01-01 for a civil date (Howard Hinnant's algorithm)
+  int32_t year = local->tm_year + 1900 - (local->tm_mon < 2);
+  int32_t era = year / 400;
+  uint32_t yoe = year - era * 400;
+  uint32_t month = local->tm_mon + 1;
+  uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + local->tm_mday - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+void learnHour(uint8_t hour, uint32_t volumeMls)
+{
+  uint32_t meanMls = baseline.meanMls[hour];
+  uint32_t sigmaMls = max(baseline.deviationMls[hour] * 5 / 4, (uint32_t)BASELINE_MIN_SIGMA_MLS);
+
+  // Score against what we had learnt so far (Q8), mean absolute deviation
+  // is ~0.8 sigma for normally distributed usage
+  int64_t deviationMls = (int64_t)volumeMls - meanMls;
+  anomalyScoreQ8 = (int32_t)constrain((deviationMls << 8) / sigmaMls, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+  anomalyHour = hour;
+  anomalyVolumeMls = volumeMls;
+  anomalyBaselineMls = meanMls;
+  anomalySigmaMls = sigmaMls;
+  anomalyPending = anomalySigma > 0 && baseline.samples[hour] >= BASELINE_MIN_SAMPLES;
+
+  if (baseline.samples[hour] == 0)
+  {
+    // First sample seeds the mean
+    baseline.meanMls[hour] = volumeMls;
+  }
+  else
+  {
+    // Clamp outliers to k sigma (3 if not scoring) so a single anomalous 
+    // hour can't drag the baseline, a lasting change is still learnt
+    int64_t limitMls = (int64_t)sigmaMls * (anomalySigma > 0 ? anomalySigma : 3);
+    deviationMls = constrain(deviationMls, -limitMls, limitMls);
+
+    int64_t absDeviationMls = deviationMls < 0 ? -deviationMls : deviationMls;
+    baseline.meanMls[hour] = (uint32_t)((int64_t)meanMls + (deviationMls >> BASELINE_SHIFT));
+    baseline.deviationMls[hour] = (uint32_t)((int64_t)baseline.deviationMls[hour] + ((absDeviationMls - (int64_t)baseline.deviationMls[hour]) >> BASELINE_SHIFT));
+  }
+
+  if (baseline.samples[hour] < UINT8_MAX)
+  {
+    baseline.samples[hour]++;
+  }
+
+  writeRecord(BASELINE_FILE, &baseline, sizeof(baseline));
+}
+
+uint8_t writeVarint(uint8_t * output, uint32_t value)
+{
+  uint8_t length = 0;
+  while (value >= 0x80)
+  {
+    output[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  output[length++] = value;
+  return length;
+}
+
+uint32_t readVarint(const uint8_t * input, uint16_t * position, uint16_t length)
+{
+  uint32_t value = 0L;
+  for (uint8_t shift = 0; shift < 35 && *position < length; shift += 7)
+  {
+    uint8_t byte = input[(*position)++];
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return value;
+}
+
+uint32_t getHistoryCrc(historyBlock * block)
+{
+  // Covers the rest of the header and the used part of the payload
+  return crc32((uint8_t *)&block->firstMinute, offsetof(historyBlock, payload) - offsetof(historyBlock, firstMinute) + block->length);
+}
+
+void getHistoryPath(uint16_t slot, char * path)
+{
+  snprintf_P(path, HISTORY_PATH_MAX_LENGTH, PSTR("%s/%03u.bin"), HISTORY_DIR, slot);
+}
+
+bool saveHistory()
+{
+  if (historyBuffer.count == 0)
+    return false;
+
+  // The block being filled is saved to the head slot, replacing whatever 
+  // that file held (a partial copy of this block, or the oldest block once 
+  // the log has wrapped)
+  char path[HISTORY_PATH_MAX_LENGTH];
+  getHistoryPath(historyHead, path);
+
+  historyBuffer.crc = getHistoryCrc(&historyBuffer);
+  File file = LittleFS.open(path, "w");
+  bool saved = file && file.write((uint8_t *)&historyBuffer, HISTORY_BLOCK_SIZE) == HISTORY_BLOCK_SIZE;
+  if (file)
+  {
+    file.close();
+  }
+
+  // Never leave a truncated block behind for the index or a query to find
+  if (!saved)
+  {
+    LittleFS.remove(path);
+    historyIndex[historyHead] = 0L;
+    return false;
+  }
+
+  historyIndex[historyHead] = historyBuffer.firstMinute;
+  return true;
+}
+
+void flushHistory()
+{
+  if (historyBuffer.count == 0)
+    return;
+
+  // Move on to the next slot once full, a failed write loses this block only
+  if (saveHistory())
+  {
+    historyHead = (historyHead + 1) % HISTORY_BLOCKS;
+  }
+  memset(&historyBuffer, 0, sizeof(historyBuffer));
+}
+
+void appendHistory(uint32_t minute, uint32_t volumeMls)
+{
+  // Entries must keep moving forward, e.g. if SNTP steps the clock back
+  if (minute <= historyLastMinute)
+    return;
+
+  if (historyBuffer.length + HISTORY_ENTRY_MAX_BYTES > HISTORY_PAYLOAD_SIZE)
+  {
+    flushHistory();
+  }
+
+  // Each block decodes on its own, so starts from its first minute and 0mL
+  if (historyBuffer.count == 0)
+  {
+    historyBuffer.firstMinute = minute;
+    historyBuffer.lastMinute = minute;
+    historyLastVolumeMls = 0L;
+  }
+
+  int32_t delta = (int32_t)min(volumeMls, (uint32_t)INT32_MAX) - (int32_t)historyLastVolumeMls;
+  uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+
+  uint8_t * output = historyBuffer.payload;
+  historyBuffer.length += writeVarint(&output[historyBuffer.length], minute - historyBuffer.lastMinute);
+  historyBuffer.length += writeVarint(&output[historyBuffer.length], zigzag);
+  historyBuffer.lastMinute = minute;
+  historyBuffer.count++;
+
+  historyLastMinute = minute;
+  historyLastVolumeMls = min(volumeMls, (uint32_t)INT32_MAX);
+}
+
+void rollMinute(uint32_t minute)
+{
+  if (minute == historyMinute)
+    return;
+
+  // Volume measured before the clock synced isn't logged
+  if (historyMinute != 0L)
+  {
+    appendHistory(historyMinute, historyMinuteMls);
+  }
+
+  historyMinute = minute;
+  historyMinuteMls = 0L;
+}
+
+void rollHour(struct tm * local)
+{
+  uint8_t hour = ((local->tm_wday + 6) % 7) * 24 + local->tm_hour;
+  if (hour == baselineHour)
+    return;
+
+  // Only learn from hours we saw from start to end
+  if (baselineHour != BASELINE_HOUR_UNKNOWN && !baselineHourPartial)
+  {
+    learnHour(baselineHour, baselineHourMls);
+  }
+
+  baselineHourPartial = baselineHour == BASELINE_HOUR_UNKNOWN;
+  baselineHour = hour;
+  baselineHourMls = 0L;
+}
+
+void rollPeriods()
+{
+  if (!isTimeValid())
+    return;
+
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+
+  rollMinute(now / 60);
+  rollHour(&local);
+
+  uint32_t day = getLocalDay(&local);
+  uint32_t month = (local.tm_year + 1900) * 12 + local.tm_mon;
+
+  // First sync ever, adopt the current periods and keep what we have
+  if (periodDay == 0L)
+  {
+    periodDay = day;
+    periodMonth = month;
+    return;
+  }
+
+  if (day == periodDay)
+    return;
+
+  // Only carry today into yesterday if it actually was yesterday
+  yesterdayMls = (day == periodDay + 1) ? todayMls : 0LL;
+  todayMls = 0LL;
+
+  // 1970-01-01 was a Thursday, so weeks (starting Monday) roll at +3
+  if ((day + 3) / 7 != (periodDay + 3) / 7)
+  {
+    weekMls = 0LL;
+  }
+
+  if (month != periodMonth)
+  {
+    monthMls = 0LL;
+  }
+
+  periodDay = day;
+  periodMonth = month;
+
+  consumptionDirty = true;
+  totalsDirty = true;
+}
+
+void addConsumption(uint64_t volumeMls)
+{
+  if (volumeMls == 0LL)
+    return;
+
+  todayMls += volumeMls;
+  weekMls += volumeMls;
+  monthMls += volumeMls;
+  baselineHourMls += volumeMls;
+  historyMinuteMls += volumeMls;
+
+  consumptionDirty = true;
+}
+
+uint32_t getVolumeMls(uint32_t pulses)
+{
+  return pulsesToMls(pulses, volumeReciprocal, kFactor);
+}
+
+uint64_t getTotalVolumeMls()
+{
+  return getTotalVolumeMls(&totals, volumeReciprocal, kFactor);
+}
+
+uint64_t getTotalReverseVolumeMls()
+{
+  return getTotalReverseVolumeMls(&totals, volumeReciprocal, kFactor);
+}
+
+void setKFactor(int factor)
+{
+  // Bank the totals so far, they were measured with the old calibration
+  bankTotals(&totals, volumeReciprocal, kFactor);
+
+  kFactor = factor;
+  volumeReciprocal = getVolumeReciprocal(kFactor);
+}
+
+void setReferenceKFactor(int factor)
+{
+  referenceKFactor = factor;
+  referenceReciprocal = factor > 0 ? getVolumeReciprocal(factor) : 0LL;
+}
+
+void resetRateTracker()
+{
+  ratePrimed = false;
+  droppedEdges = 0L;
+  periodQ4 = 0L;
+  periodSlopeQ4 = 0L;
+}
+
+void attachInputs()
+{
+  detachInterrupt(I2C_SDA);
+  detachInterrupt(I2C_SCL);
+
+  // Enable internal pullups on both sensor pins
+  pinMode(I2C_SDA, INPUT_PULLUP);
+  pinMode(I2C_SCL, INPUT_PULLUP);
+
+  if (inputMode == INPUT_MODE_QUADRATURE)
+  {
+    // Decode both phases on every transition
+    quadratureState = (digitalRead(QUADRATURE_PIN_A) << 1) | digitalRead(QUADRATURE_PIN_B);
+    quadratureStep = 0;
+    attachInterrupt(QUADRATURE_PIN_A, isrQuadrature, CHANGE);
+    attachInterrupt(QUADRATURE_PIN_B, isrQuadrature, CHANGE);
+  }
+  else if (inputMode == INPUT_MODE_FREQUENCY)
+  {
+    frequencyRefValid = false;
+    attachInterrupt(I2C_SDA, isrFrequency, FALLING);
+  }
+  else
+  {
+    // Setup the sensor pin to trigger our interrupt service routine when 
+    // pin goes from HIGH to LOW, i.e. FALLING edge, and the same again for 
+    // the (optional) reference meter
+    attachInterrupt(I2C_SDA, isr, FALLING);
+    attachInterrupt(REFERENCE_PIN, isrReference, FALLING);
+  }
+}
+
+void startFlow()
+{
+  if (flowing)
+    return;
+
+  flowing = true;
+  flowEventPending = true;
+  flowStartedMs = millis();
+}
+
+void stopFlow(uint32_t stoppedAgoMs)
+{
+  if (!flowing)
+    return;
+
+  flowing = false;
+  flowEventPending = true;
+  flowDurationMs = millis() - flowStartedMs - stoppedAgoMs;
+}
+
+bool isAboveFrequencyOffset()
+{
+  // Compare periods rather than dividing, i.e. frequency > offset
+  return periodQ4 > 0L && (uint64_t)periodQ4 * frequencyOffsetMhz < PERIOD_Q4_MHZ;
+}
+
+void setInputMode(uint8_t mode)
+{
+  if (mode == inputMode)
+    return;
+
+  inputMode = mode;
+  attachInputs();
+
+  // Timing across the switch is meaningless, so drop any edges timed in the
+  // old mode, and end any flow it was tracking (nothing else would)
+  uint8_t tail;
+  releaseEdges(&edgeBuffer, peekEdges(&edgeBuffer, &tail));
+  resetRateTracker();
+  stopFlow(0L);
+
+  // Sensors depend on the mode, so re-publish discovery config
+  hassDiscoveryPublished = false;
+}
+
+void updateRateTracker(uint32_t edges, uint32_t newestMicros)
+{
+  // Need a reference edge before we can measure any intervals
+  if (!ratePrimed)
+  {
+    lastEdgeMicros = newestMicros;
+    ratePrimed = true;
+    return;
+  }
+
+  // Mean inter-pulse period across this batch of edges
+  uint32_t spanMicros = newestMicros - lastEdgeMicros;
+  lastEdgeMicros = newestMicros;
+  int32_t measuredQ4 = (int32_t)min(spanMicros / edges, (uint32_t)(INT32_MAX >> 4)) << 4;
+
+  // First measurement seeds the tracker
+  if (periodQ4 == 0L)
+  {
+    periodQ4 = max(measuredQ4, (int32_t)1);
+    return;
+  }
+
+  // Predict the period 'edges' pulses ahead, then correct by the residual
+  int64_t predictedQ4 = (int64_t)periodQ4 + (int64_t)periodSlopeQ4 * edges;
+  int64_t residualQ4 = measuredQ4 - predictedQ4;
+
+  predictedQ4 += (alphaQ8 * residualQ4) >> 8;
+  periodQ4 = (int32_t)constrain(predictedQ4, (int64_t)1, (int64_t)INT32_MAX);
+  periodSlopeQ4 += (int32_t)(((betaQ8 * residualQ4) >> 8) / edges);
+}
+
+void processIntervals(uint8_t tail, uint8_t head)
+{
+  // Intervals are only meaningful if we have a reference edge, and not if 
+  // there were untimed edges between it and this batch
+  uint32_t previousMicros = lastEdgeMicros;
+  bool primed = ratePrimed && droppedEdges == 0L;
+
+  for (uint8_t i = tail; i != head; i++)
+  {
+    uint32_t edge = getEdge(&edgeBuffer, i);
+    if (primed)
+    {
+      // Faster than any real meter, most likely electrical noise
+      uint32_t interval = edge - previousMicros;
+      if (interval < GLITCH_INTERVAL_US && inputMode != INPUT_MODE_FREQUENCY)
+      {
+        windowQuality |= QUALITY_GLITCHES;
+      }
+
+      // Bucket is the position of the highest set bit, O(1) via clz
+      int8_t bucket = interval ? (31 - __builtin_clz(interval)) - HISTOGRAM_BASE_BIT : 0;
+      intervalHistogram[constrain(bucket, 0, HISTOGRAM_BUCKETS - 1)]++;
+    }
+
+    previousMicros = edge;
+    primed = true;
+  }
+}
+
+void processEdges()
+{
+  // Snapshot the head, the ISR may keep writing beyond it while we work
+  uint8_t tail;
+  uint8_t head = peekEdges(&edgeBuffer, &tail);
+  uint8_t edges = head - tail;
+  if (edges == 0)
+    return;
+
+  uint32_t newestMicros = getEdge(&edgeBuffer, head - 1);
+
+  // Must be done before the rate tracker moves its reference edge
+  processIntervals(tail, head);
+  releaseEdges(&edgeBuffer, head);
+
+  // Any edges dropped so far came after the newest one in this batch
+  uint32_t overflowCount = edgeBuffer.overflowCount;
+  uint32_t newlyDropped = overflowCount - lastEdgeOverflowCount;
+  lastEdgeOverflowCount = overflowCount;
+
+  // Include edges dropped before this batch, so the mean period is still
+  // right (just over a longer span), then carry the new ones to the next
+  updateRateTracker(edges + droppedEdges, newestMicros);
+  droppedEdges = newlyDropped;
+
+  if (inputMode == INPUT_MODE_FREQUENCY)
+  {
+    // Frequency meters can keep pulsing at zero flow (the offset), so flow
+    // follows the measured frequency rather than the arrival of edges
+    if (isAboveFrequencyOffset())
+    {
+      startFlow();
+    }
+    else
+    {
+      stopFlow(0L);
+    }
+  }
+  else
+  {
+    // First pulse after an idle period means flow has started
+    startFlow();
+  }
+}
+
+int32_t getDriftPermille()
+{
+  return ((int64_t)(driftRatioQ16 - DRIFT_RATIO_ONE_Q16) * 1000) >> 16;
+}
+
+void updateDrift(uint32_t mainPulses, uint32_t referencePulses)
+{
+  if (referenceKFactor == 0)
+    return;
+
+  driftMainPulses += mainPulses;
+  driftReferencePulses += referencePulses;
+
+  // Wait until the reference has measured a full comparison window (and
+  // at least one pulse, whatever the window)
+  if (driftReferencePulses == 0L || (uint64_t)driftReferencePulses * 1000 < (uint64_t)driftWindowMls * referenceKFactor)
+    return;
+
+  // Ratio of main to reference volume over this window, in Q16
+  int32_t ratioQ16 = (int32_t)min(((uint64_t)driftMainPulses * referenceKFactor << 16) / 
+    ((uint64_t)driftReferencePulses * kFactor), (uint64_t)INT32_MAX);
+
+  driftMainPulses = 0L;
+  driftReferencePulses = 0L;
+
+  // Smooth across windows so a single odd window doesn't raise an alert
+  if (driftRatioQ16 == 0L)
+  {
+    driftRatioQ16 = ratioQ16;
+  }
+  else
+  {
+    driftRatioQ16 += (ratioQ16 - driftRatioQ16) >> DRIFT_SMOOTHING_SHIFT;
+  }
+
+  totalsDirty = true;
+
+  // Raise (or clear) the alert when crossing the threshold
+  bool alert = (uint32_t)abs(getDriftPermille()) > driftAlertPermille;
+  if (alert != driftAlerted)
+  {
+    driftAlerted = alert;
+    driftEventPending = true;
+  }
+}
+
+void commitWindow(telemetryWindow * window)
+{
+  lastTelemetryMs = millis();
+  windowSeq++;
+  windowQuality = 0;
+  windowOverflowBase += window->edgeOverflowCount;
+
+  // Add this window to our totals, billed to the band and period it was 
+  // measured in, whenever it is sent
+  uint64_t windowVolumeMls = commitTotals(&totals, window, inputMode == INPUT_MODE_FREQUENCY, volumeReciprocal, kFactor);
+  addConsumption(windowVolumeMls);
+
+  if (inputMode == INPUT_MODE_FREQUENCY)
+  {
+    // Last edge of this window is the reference for the next one
+    frequencyRefMicros = window->edgeMicros;
+    frequencyRefValid = window->pulseCount > 0;
+  }
+
+  if (window->pulseCount > 0 || window->reversePulseCount > 0)
+  {
+    totalsDirty = true;
+    totalsPublishDirty = true;
+  }
+
+  // Only remove what we measured so pulses counted meanwhile carry over
+  noInterrupts();
+  pulseCount -= window->pulseCount;
+  referencePulseCount -= window->referencePulseCount;
+  reversePulseCount -= window->reversePulseCount;
+  interrupts();
+
+  updateDrift(window->pulseCount, window->referencePulseCount);
+}
+
+#if defined(PULSE_CONSERVATION_CHECK)
+uint32_t getQueuedPulseCount(uint8_t count)
+{
+  // Pulses in the oldest count windows, committed but not yet published
+  uint32_t pulses = 0L;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    pulses += windowQueue.windows[i].pulseCount;
+  }
+  return pulses;
+}
+#endif
+
+void releaseWindows(uint8_t count)
+{
+  // The oldest count windows have been delivered, so are done with
+#if defined(PULSE_CONSERVATION_CHECK)
+  publishedPulseCount += getQueuedPulseCount(count);
+#endif
+  dequeueWindows(&windowQueue, count);
+}
+
+void onWindowsSent(uint8_t count)
+{
+  // Without acks a window is delivered as soon as it has gone out
+  if (ackTimeoutMs == 0L)
+  {
+    releaseWindows(count);
+    return;
+  }
+
+  // Otherwise it stays queued until acked, timed from the first one sent
+  if (sentWindowCount == 0)
+  {
+    lastAckMs = millis();
+  }
+  sentWindowCount += count;
+}
+
+void resendWindows()
+{
+  // Send everything still waiting for an ack again, from the oldest
+  windowResends += sentWindowCount;
+  sentWindowCount = 0;
+}
+
+void checkAckTimeout()
+{
+  if (sentWindowCount == 0 || (millis() - lastAckMs) < ackTimeoutMs)
+    return;
+
+  resendWindows();
+}
+
+void ackWindows(uint32_t boot, uint32_t seq)
+{
+  uint8_t count = getAckedWindowCount(&windowQueue, boot, seq);
+  if (count == 0)
+    return;
+
+  releaseWindows(count);
+  sentWindowCount = count < sentWindowCount ? sentWindowCount - count : 0;
+  lastAckMs = millis();
+}
+
+void retryWindows()
+{
+  // Windows stay queued for the next attempt, but count each failed 
+  // publish so delivery problems are visible downstream
+  publishFailed = true;
+  lastPublishFailureMs = millis();
+  telemetryPublishFailures++;
+}
+
+bool isPublishBackingOff()
+{
+  // Wait a telemetry interval after a failure, rather than retrying every pass
+  return publishFailed && (millis() - lastPublishFailureMs) < telemetryIntervalMs;
+}
+
+void onOutputPublished(uint8_t output)
+{
+  switch (output)
+  {
+    case OUTPUT_FLOW_EVENT:
+      flowEventPending = false;
+      break;
+
+    case OUTPUT_DRIFT_EVENT:
+      driftEventPending = false;
+      break;
+
+    case OUTPUT_HISTOGRAM:
+      lastHistogramMs = millis();
+      memset(intervalHistogram, 0, sizeof(intervalHistogram));
+      break;
+
+    case OUTPUT_CONSUMPTION:
+      lastConsumptionMs = millis();
+      consumptionDirty = false;
+      break;
+
+    case OUTPUT_CAPTURE:
+      // Start a fresh pre-trigger history for the next capture
+      capturePending = false;
+      captureTrigger = NULL;
+      captureCount = 0;
+      lastCaptureSampleMs = millis();
+      break;
+
+    case OUTPUT_ANOMALY:
+      anomalyPending = false;
+      break;
+
+    case OUTPUT_TOTALS:
+      lastTotalsPublishMs = millis();
+      totalsPublishDirty = false;
+      break;
+
+    case OUTPUT_BATCH:
+      lastBatchMs = millis();
+      publishFailed = false;
+      onWindowsSent(batchWindowCount);
+      break;
+
+    case OUTPUT_TELEMETRY:
+      publishFailed = false;
+      onWindowsSent(1);
+      break;
+  }
+}
+
+bool publishOutput(uint8_t output, JsonVariant json, bool retained)
+{
+  if (!envelopeMode)
+  {
+    if (!publishTopic(OUTPUT_TOPICS[output], json, retained))
+      return false;
+
+    onOutputPublished(output);
+    return true;
+  }
+
+  // Coalesce into this pass's envelope, sent once at the end of loop()
+  if (!envelope)
+  {
+    envelope = new DynamicJsonDocument(ENVELOPE_JSON_SIZE);
+  }
+
+  // Leave the output pending for the next pass if the envelope is full
+  if ((*envelope)[OUTPUT_KEYS[output]].set(json))
+  {
+    envelopeOutputs |= 1 << output;
+  }
+  else
+  {
+    envelope->remove(OUTPUT_KEYS[output]);
+  }
+  return false;
+}
+
+void publishEnvelope()
+{
+  if (!envelope)
+    return;
+
+  // Envelopes are never retained, retained state lives on the per-topic mode
+  bool published = envelopeOutputs != 0 && publishTopic(TOPIC_ENVELOPE, envelope->as<JsonVariant>(), false);
+
+  for (uint8_t output = 0; output < OUTPUT_COUNT; output++)
+  {
+    if ((envelopeOutputs & (1 << output)) == 0)
+      continue;
+
+    if (published)
+    {
+      onOutputPublished(output);
+    }
+    else if (output == OUTPUT_TELEMETRY || output == OUTPUT_BATCH)
+    {
+      retryWindows();
+    }
+  }
+
+  envelope->clear();
+  envelopeOutputs = 0;
+}
+
+void publishHistogram()
+{
+  if (histogramIntervalMs == 0L || (millis() - lastHistogramMs) < histogramIntervalMs)
+    return;
+
+  StaticJsonDocument<512> json;
+  json["elapsedMs"] = millis() - lastHistogramMs;
+  json["bucketBaseUs"] = 1 << HISTOGRAM_BASE_BIT;
+
+  JsonArray counts = json.createNestedArray("counts");
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    counts.add(intervalHistogram[i]);
+  }
+
+  // Reset once published, so each message covers a single period
+  publishOutput(OUTPUT_HISTOGRAM, json, false);
+}
+
+void publishAnomaly()
+{
+  if (!anomalyPending)
+    return;
+
+  StaticJsonDocument<192> json;
+  json["hourOfWeek"] = anomalyHour;
+  json["volumeMls"] = anomalyVolumeMls;
+  json["baselineMls"] = anomalyBaselineMls;
+  json["sigmaMls"] = anomalySigmaMls;
+  json["score"] = (float)anomalyScoreQ8 / 256;
+  json["anomaly"] = (uint32_t)abs(anomalyScoreQ8) >= ((uint32_t)anomalySigma << 8);
+
+  publishOutput(OUTPUT_ANOMALY, json, false);
+}
+
+void publishDriftEvent()
+{
+  if (!driftEventPending)
+    return;
+
+  StaticJsonDocument<64> json;
+  json["event"] = driftAlerted ? "driftAlert" : "driftCleared";
+  json["driftPermille"] = getDriftPermille();
+
+  publishOutput(OUTPUT_DRIFT_EVENT, json, false);
+}
+
+void checkZeroFlow()
+{
+  if (!ratePrimed)
+  {
+    resetEdgeActivity(&zeroFlowActivity, &edgeBuffer, micros());
+    return;
+  }
+
+  // The tracker only sees edges, so once the meter has gone quiet for longer
+  // than its slowest rated pulse period the flow has stopped (edges dropped
+  // during a stall still count, even though the last timed one is old)
+  uint32_t idleMs = getEdgeIdleMs(&zeroFlowActivity, &edgeBuffer, lastEdgeMicros, micros());
+  if (idleMs >= zeroFlowTimeoutMs)
+  {
+    resetRateTracker();
+    stopFlow(idleMs);
+  }
+}
+
+void publishFlowEvent()
+{
+  if (!flowEventPending)
+    return;
+
+  StaticJsonDocument<64> json;
+  if (flowing)
+  {
+    json["event"] = "flowStarted";
+  }
+  else
+  {
+    json["event"] = "flowStopped";
+    json["durationMs"] = flowDurationMs;
+  }
+
+  // Keep retrying each loop until it goes out
+  publishOutput(OUTPUT_FLOW_EVENT, json, false);
+}
+
+uint32_t getFrequencyMhz(uint32_t edges, uint32_t lastEdgeMicros, uint32_t elapsedMs)
+{
+  if (edges == 0L)
+    return 0L;
+
+  uint32_t frequencyMhz;
+  if (frequencyRefValid)
+  {
+    // Reciprocal counting, these edges span a whole number of periods since 
+    // the reference edge, so resolution is set by the 1us timer, not the gate
+    uint32_t spanMicros = lastEdgeMicros - frequencyRefMicros;
+    uint64_t frequency = (uint64_t)edges * 1000000000ULL / max(spanMicros, (uint32_t)1);
+    frequencyMhz = (uint32_t)min(frequency, (uint64_t)UINT32_MAX);
+  }
+  else
+  {
+    // No reference yet, fall back to counting edges over the gate period
+    frequencyMhz = (uint64_t)edges * 1000000ULL / max(elapsedMs, (uint32_t)1);
+  }
+
+  return frequencyMhz;
+}
+
+uint32_t getFrequencyRateMlsPerMin(uint32_t frequencyMhz)
+{
+  return frequencyToMlsPerMin(frequencyMhz, frequencyOffsetMhz, frequencyScaleQ16);
+}
+
+uint32_t getRateMlsPerMin()
+{
+  if (periodQ4 == 0L)
+    return 0L;
+
+  // Tracking the output period of a frequency meter, so scale its frequency
+  if (inputMode == INPUT_MODE_FREQUENCY)
+    return getFrequencyRateMlsPerMin((uint32_t)min((uint64_t)(PERIOD_Q4_MHZ / periodQ4), (uint64_t)UINT32_MAX));
+
+  // 60,000,000us/min * 1000mL/L * 16 (Q4) / (period * pulses per litre)
+  uint64_t rate = 960000000000ULL / ((uint64_t)periodQ4 * kFactor);
+  return (uint32_t)min(rate, (uint64_t)UINT32_MAX);
+}
+
+int32_t getRateChangeMlsPerMin(uint32_t rateMlsPerMin)
+{
+  if (periodQ4 == 0L)
+    return 0L;
+
+  // Rate is inversely proportional to the period, so d(rate)/dt is
+  // -rate * (d(period)/pulse) / period^2, scaled to a change per second
+  int64_t ratePerPulse = (int64_t)rateMlsPerMin * periodSlopeQ4 / periodQ4;
+  int64_t rateChange = -ratePerPulse * 1000000LL / max(periodQ4 >> 4, (int32_t)1);
+  return (int32_t)constrain(rateChange, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+}
+
+void sampleCapture()
+{
+  if (captureRateStepMlsPerMin == 0L || capturePending)
+    return;
+
+  if ((millis() - lastCaptureSampleMs) < CAPTURE_SAMPLE_MS)
+    return;
+
+  // Keep a steady cadence, unless we've fallen a whole sample behind
+  lastCaptureSampleMs += CAPTURE_SAMPLE_MS;
+  if ((millis() - lastCaptureSampleMs) >= CAPTURE_SAMPLE_MS)
+  {
+    lastCaptureSampleMs = millis();
+  }
+
+  uint16_t sample = min(getRateMlsPerMin() / CAPTURE_RATE_UNIT_MLS, (uint32_t)UINT16_MAX);
+  captureSamples[captureHead++ & CAPTURE_SAMPLES_MASK] = sample;
+  if (captureCount < CAPTURE_SAMPLES)
+  {
+    captureCount++;
+  }
+
+  // Already triggered, wait for the post-trigger samples
+  if (captureTrigger)
+  {
+    if (--capturePostRemaining == 0)
+    {
+      capturePending = true;
+    }
+    return;
+  }
+
+  bool flowChanged = flowing != captureFlowing;
+  captureFlowing = flowing;
+
+  // Need a full pre-trigger history before we can trigger
+  if (captureCount < CAPTURE_PRE_SAMPLES)
+    return;
+
+  uint16_t previous = captureSamples[(captureHead - 1 - CAPTURE_STEP_SAMPLES) & CAPTURE_SAMPLES_MASK];
+  uint32_t stepMlsPerMin = (uint32_t)abs((int32_t)sample - (int32_t)previous) * CAPTURE_RATE_UNIT_MLS;
+
+  if (flowChanged)
+  {
+    captureTrigger = flowing ? "flowStarted" : "flowStopped";
+  }
+  else if (stepMlsPerMin >= captureRateStepMlsPerMin)
+  {
+    captureTrigger = "rateStep";
+  }
+
+  if (captureTrigger)
+  {
+    capturePostRemaining = CAPTURE_SAMPLES - CAPTURE_PRE_SAMPLES;
+  }
+}
+
+void publishCapture()
+{
+  if (!capturePending)
+    return;
+
+  // Oldest sample first, each a little-endian uint16 in units of 10mL/min
+  uint8_t blob[CAPTURE_SAMPLES * 2];
+  for (uint8_t i = 0; i < CAPTURE_SAMPLES; i++)
+  {
+    uint16_t sample = captureSamples[(uint8_t)(captureHead + i) & CAPTURE_SAMPLES_MASK];
+    blob[i * 2] = sample & 0xFF;
+    blob[i * 2 + 1] = sample >> 8;
+  }
+  encodeBase64(blob, sizeof(blob), captureBase64);
+
+  StaticJsonDocument<256> json;
+  json["trigger"] = captureTrigger;
+  json["sampleMs"] = CAPTURE_SAMPLE_MS;
+  json["preSamples"] = CAPTURE_PRE_SAMPLES;
+  json["rateUnitMlsPerMin"] = CAPTURE_RATE_UNIT_MLS;
+  json["samples"] = (const char *)captureBase64;
+
+  // Sampling stays paused (keeping this capture intact) until it goes out
+  publishOutput(OUTPUT_CAPTURE, json, false);
+}
+
+void setConfigSchema()
+{
+  // Define our config schema (on the heap, it has outgrown the stack)
+  DynamicJsonDocument json(4096);
+  
+  JsonObject telemetryIntervalMs = json.createNestedObject("telemetryIntervalMs");
+  telemetryIntervalMs["title"] = "Telemetry Interval (ms)";
+  telemetryIntervalMs["description"] = "How often to publish telemetry data (defaults to 1000ms, i.e. 1 second)";
+  telemetryIntervalMs["type"] = "integer";
+  telemetryIntervalMs["minimum"] = 1;
+  telemetryIntervalMs["maximum"] = TELEMETRY_INTERVAL_MS_MAX;
+
+  JsonObject kFactor = json.createNestedObject("kFactor");
+  kFactor["title"] = "K-Factor";
+  kFactor["description"] = "Number of pulses per litre (defaults to 49, check flow sensor specs)";
+  kFactor["type"] = "integer";
+  kFactor["minimum"] = 1;
+  kFactor["maximum"] = K_FACTOR_MAX;
+
+  JsonObject rateFilterGain = json.createNestedObject("rateFilterGain");
+  rateFilterGain["title"] = "Rate Filter Gain (%)";
+  rateFilterGain["description"] = "How quickly the flow rate follows changes in pulse timing, lower values are smoother but slower to respond (defaults to 25%, 100% disables smoothing)";
+  rateFilterGain["type"] = "integer";
+  rateFilterGain["minimum"] = 1;
+  rateFilterGain["maximum"] = RATE_FILTER_GAIN_MAX;
+
+  JsonObject minPulseFrequency = json.createNestedObject("minPulseFrequency");
+  minPulseFrequency["title"] = "Minimum Pulse Frequency (Hz)";
+  minPulseFrequency["description"] = "Pulse frequency at the lowest rated flow of the sensor, flow is reported as stopped after two of these periods without a pulse (defaults to 2Hz, check flow sensor specs)";
+  minPulseFrequency["type"] = "number";
+  minPulseFrequency["minimum"] = MIN_PULSE_FREQUENCY_MIN;
+  minPulseFrequency["maximum"] = MIN_PULSE_FREQUENCY_MAX;
+
+  JsonObject envelopeMode = json.createNestedObject("envelopeMode");
+  envelopeMode["title"] = "Envelope Mode";
+  envelopeMode["description"] = "Coalesce the telemetry, events and diagnostics produced in each pass into a single message on the <telemetry>/envelope topic, Home Assistant discovery only works with the default per-topic mode (defaults to false)";
+  envelopeMode["type"] = "boolean";
+
+  JsonObject inputMode = json.createNestedObject("inputMode");
+  inputMode["title"] = "Input Mode";
+  inputMode["description"] = "Pulse counts falling edges on the sensor pin, quadrature decodes a two-phase (bidirectional) meter using the second input as phase B, frequency measures a meter whose output frequency is proportional to flow (defaults to pulse)";
+  inputMode["type"] = "string";
+  JsonArray inputModeEnum = inputMode.createNestedArray("enum");
+  inputModeEnum.add("pulse");
+  inputModeEnum.add("quadrature");
+  inputModeEnum.add("frequency");
+
+  JsonObject frequencyScale = json.createNestedObject("frequencyScale");
+  frequencyScale["title"] = "Frequency Scale (mL/min per Hz)";
+  frequencyScale["description"] = "Flow rate per Hz above the offset, frequency input mode only (defaults to 1.0, check flow meter specs)";
+  frequencyScale["type"] = "number";
+  frequencyScale["minimum"] = 0;
+  frequencyScale["maximum"] = FREQUENCY_SCALE_MAX;
+
+  JsonObject frequencyOffsetHz = json.createNestedObject("frequencyOffsetHz");
+  frequencyOffsetHz["title"] = "Frequency Offset (Hz)";
+  frequencyOffsetHz["description"] = "Output frequency at zero flow, frequency input mode only (defaults to 0Hz)";
+  frequencyOffsetHz["type"] = "number";
+  frequencyOffsetHz["minimum"] = 0;
+  frequencyOffsetHz["maximum"] = FREQUENCY_OFFSET_HZ_MAX;
+
+  JsonObject referenceKFactor = json.createNestedObject("referenceKFactor");
+  referenceKFactor["title"] = "Reference K-Factor";
+  referenceKFactor["description"] = "Number of pulses per litre for a reference meter in series on the second input, used to estimate K-factor drift, pulse input mode only (defaults to 0, i.e. no reference meter)";
+  referenceKFactor["type"] = "integer";
+  referenceKFactor["minimum"] = 0;
+  referenceKFactor["maximum"] = K_FACTOR_MAX;
+
+  JsonObject driftWindowLitres = json.createNestedObject("driftWindowLitres");
+  driftWindowLitres["title"] = "Drift Window (L)";
+  driftWindowLitres["description"] = "Volume through the reference meter to compare over for each drift estimate (defaults to 1000L)";
+  driftWindowLitres["type"] = "integer";
+  driftWindowLitres["minimum"] = 1;
+  driftWindowLitres["maximum"] = DRIFT_WINDOW_LITRES_MAX;
+
+  JsonObject driftAlertPermille = json.createNestedObject("driftAlertPermille");
+  driftAlertPermille["title"] = "Drift Alert Threshold (per mille)";
+  driftAlertPermille["description"] = "Raise an alert when the meters disagree by more than this, in parts per thousand (defaults to 20, i.e. 2%)";
+  driftAlertPermille["type"] = "integer";
+  driftAlertPermille["minimum"] = 1;
+  driftAlertPermille["maximum"] = DRIFT_ALERT_PERMILLE_MAX;
+
+  JsonObject telemetryFields = json.createNestedObject("telemetryFields");
+  telemetryFields["title"] = "Telemetry Fields";
+  telemetryFields["description"] = "Which fields to include in telemetry, to minimise message size on constrained links (defaults to everything except timestamp)";
+  telemetryFields["type"] = "array";
+  telemetryFields["uniqueItems"] = true;
+  JsonObject telemetryFieldItems = telemetryFields.createNestedObject("items");
+  telemetryFieldItems["type"] = "string";
+  JsonArray telemetryFieldEnum = telemetryFieldItems.createNestedArray("enum");
+  for (uint8_t field = 0; field < FIELD_COUNT; field++)
+  {
+    telemetryFieldEnum.add(FIELD_KEYS[field][0]);
+  }
+
+  JsonObject shortKeys = json.createNestedObject("shortKeys");
+  shortKeys["title"] = "Short Telemetry Keys";
+  shortKeys["description"] = "Use abbreviated keys in telemetry, e.g. 'v' instead of 'volumeMls' (defaults to false)";
+  shortKeys["type"] = "boolean";
+
+  JsonObject batchIntervalMins = json.createNestedObject("batchIntervalMins");
+  batchIntervalMins["title"] = "Batch Upload Interval (mins)";
+  batchIntervalMins["description"] = "Queue telemetry windows and upload them together this often, up to 30 windows are queued after which adjacent windows are merged, so longer intervals have a coarser resolution (defaults to 0, i.e. publish each window as it closes)";
+  batchIntervalMins["type"] = "integer";
+  batchIntervalMins["minimum"] = 0;
+  batchIntervalMins["maximum"] = BATCH_INTERVAL_MINS_MAX;
+
+  JsonObject ackTimeoutSecs = json.createNestedObject("ackTimeoutSecs");
+  ackTimeoutSecs["title"] = "Ack Timeout (secs)";
+  ackTimeoutSecs["description"] = "Keep each telemetry window queued until its (boot, seq) is acked with an 'ack' command, sending any still unacked again after this long, up to 8 windows (or a single batch) are sent ahead of the last ack (defaults to 0, i.e. no acks, a window is done with once published)";
+  ackTimeoutSecs["type"] = "integer";
+  ackTimeoutSecs["minimum"] = 0;
+  ackTimeoutSecs["maximum"] = ACK_TIMEOUT_SECS_MAX;
+
+  JsonObject captureRateStep = json.createNestedObject("captureRateStepMlsPerMin");
+  captureRateStep["title"] = "Capture Rate Step (mL/min)";
+  captureRateStep["description"] = "Record 50ms flow rate samples either side of a rate change this large within 200ms, or a flow start/stop, and publish them to the <telemetry>/capture topic (defaults to 0, i.e. disabled)";
+  captureRateStep["type"] = "integer";
+  captureRateStep["minimum"] = 0;
+  captureRateStep["maximum"] = CAPTURE_RATE_STEP_MAX;
+
+  JsonObject anomalySigma = json.createNestedObject("anomalySigma");
+  anomalySigma["title"] = "Anomaly Threshold (sigma)";
+  anomalySigma["description"] = "Publish each hour's usage scored against the learnt baseline for that hour of the week to the <telemetry>/anomaly topic, flagged as an anomaly beyond this many standard deviations (defaults to 0, i.e. disabled, the baseline is always learnt)";
+  anomalySigma["type"] = "integer";
+  anomalySigma["minimum"] = 0;
+  anomalySigma["maximum"] = ANOMALY_SIGMA_MAX;
+
+  JsonObject histogramIntervalMins = json.createNestedObject("histogramIntervalMins");
+  histogramIntervalMins["title"] = "Pulse Interval Histogram (mins)";
+  histogramIntervalMins["description"] = "How often to publish a histogram of the time between pulses, for diagnosing worn or aerated meters (defaults to 0, i.e. disabled)";
+  histogramIntervalMins["type"] = "integer";
+  histogramIntervalMins["minimum"] = 0;
+  histogramIntervalMins["maximum"] = HISTOGRAM_INTERVAL_MINS_MAX;
+
+  JsonObject timezone = json.createNestedObject("timezone");
+  timezone["title"] = "Timezone";
+  timezone["description"] = "POSIX timezone string used for tariff bands, e.g. NZST-12NZDT,M9.5.0,M4.1.0/3 (defaults to UTC0)";
+  timezone["type"] = "string";
+  timezone["maxLength"] = TIMEZONE_MAX_LENGTH - 1;
+
+  JsonObject ntpServer = json.createNestedObject("ntpServer");
+  ntpServer["title"] = "NTP Server";
+  ntpServer["description"] = "Time server to sync the local clock from (defaults to pool.ntp.org)";
+  ntpServer["type"] = "string";
+  ntpServer["maxLength"] = NTP_SERVER_MAX_LENGTH - 1;
+
+  JsonObject tariffBands = json.createNestedObject("tariffBands");
+  tariffBands["title"] = "Tariff Bands";
+  tariffBands["description"] = "Time-of-use periods to total volume separately for billing, anything outside these periods is totalled as band 0 (max 4 bands)";
+  tariffBands["type"] = "array";
+  tariffBands["maxItems"] = TARIFF_BAND_MAX;
+
+  JsonObject tariffBandItems = tariffBands.createNestedObject("items");
+  tariffBandItems["type"] = "object";
+
+  JsonObject tariffBandProperties = tariffBandItems.createNestedObject("properties");
+
+  JsonObject days = tariffBandProperties.createNestedObject("days");
+  days["title"] = "Days";
+  days["type"] = "string";
+  JsonArray daysEnum = days.createNestedArray("enum");
+  daysEnum.add("all");
+  daysEnum.add("weekday");
+  daysEnum.add("weekend");
+
+  JsonObject start = tariffBandProperties.createNestedObject("start");
+  start["title"] = "Start (HH:MM)";
+  start["type"] = "string";
+  start["pattern"] = "^([01][0-9]|2[0-3]):[0-5][0-9]$";
+
+  JsonObject end = tariffBandProperties.createNestedObject("end");
+  end["title"] = "End (HH:MM)";
+  end["type"] = "string";
+  end["pattern"] = "^([01][0-9]|2[0-4]):[0-5][0-9]$";
+
+  JsonArray tariffBandRequired = tariffBandItems.createNestedArray("required");
+  tariffBandRequired.add("start");
+  tariffBandRequired.add("end");
+
+  // Add any Home Assistant config
+  hass.setConfigSchema(json);
+
+  // Pass our config schema down to the Room8266 library
+  oxrs.setConfigSchema(json.as<JsonVariant>());
+}
+
+void setCommandSchema()
+{
+  // Define our command schema
+  StaticJsonDocument<512> json;
+
+  JsonObject historyQuery = json.createNestedObject("historyQuery");
+  historyQuery["title"] = "History Query";
+  historyQuery["description"] = "Publish the logged per-minute volumes between two times (epoch seconds) to the <telemetry>/history topic, 100 minutes per response with 'next' set to continue from if there are more";
+  historyQuery["type"] = "object";
+
+  JsonObject historyQueryProperties = historyQuery.createNestedObject("properties");
+
+  JsonObject from = historyQueryProperties.createNestedObject("from");
+  from["title"] = "From (epoch secs)";
+  from["type"] = "integer";
+  from["minimum"] = 0;
+
+  JsonObject to = historyQueryProperties.createNestedObject("to");
+  to["title"] = "To (epoch secs)";
+  to["type"] = "integer";
+  to["minimum"] = 0;
+
+  JsonObject ack = json.createNestedObject("ack");
+  ack["title"] = "Ack";
+  ack["description"] = "Acknowledge every queued telemetry window up to and including this (boot, seq), when acks are enabled (see ackTimeoutSecs)";
+  ack["type"] = "object";
+
+  JsonObject ackProperties = ack.createNestedObject("properties");
+
+  JsonObject boot = ackProperties.createNestedObject("boot");
+  boot["title"] = "Boot";
+  boot["type"] = "integer";
+  boot["minimum"] = 0;
+
+  JsonObject seq = ackProperties.createNestedObject("seq");
+  seq["title"] = "Seq";
+  seq["type"] = "integer";
+  seq["minimum"] = 0;
+
+  // Pass our command schema down to the Room8266 library
+  oxrs.setCommandSchema(json.as<JsonVariant>());
+}
+
+#if defined(PULSE_CONSERVATION_CHECK)
+void checkPulseConservation()
+{
+  if ((millis() - lastPulseCheckMs) < PULSE_CHECK_INTERVAL_MS)
+    return;
+
+  lastPulseCheckMs = millis();
+
+  // Snapshot both counters together so a pulse can't land in between
+  noInterrupts();
+  uint32_t shadow = shadowPulseCount;
+  uint32_t pending = pulseCount;
+  interrupts();
+
+  // Pending covers windows still queued as well as the open window, so a 
+  // window dropped from a full queue shows up here
+  pending += getQueuedPulseCount(windowQueue.count);
+
+  // Everything the ISR counted must be either published or still pending
+  uint32_t accounted = publishedPulseCount + pending;
+  if (accounted != shadow)
+  {
+    oxrs.print(F("[flow] pulse conservation error, shadow: "));
+    oxrs.print(shadow);
+    oxrs.print(F(", published + pending: "));
+    oxrs.println(accounted);
+
+    // Re-sync so we only report each new discrepancy once
+    publishedPulseCount = shadow - pending;
+  }
+}
+#endif
+
+void loadBaseline()
+{
+  memset(&baseline, 0, sizeof(baseline));
+  if (!readRecord(BASELINE_FILE, &baseline, sizeof(baseline)))
+  {
+    memset(&baseline, 0, sizeof(baseline));
+    oxrs.println(F("[flow] no saved baseline found, learning from scratch"));
+  }
+}
+
+void loadHistory()
+{
+  memset(historyIndex, 0, sizeof(historyIndex));
+  memset(&historyBuffer, 0, sizeof(historyBuffer));
+
+  // Rebuild the index from the block headers, the newest block tells us 
+  // where to write next (a block saved part full is left as it is)
+  for (uint16_t slot = 0; slot < HISTORY_BLOCKS; slot++)
+  {
+    char path[HISTORY_PATH_MAX_LENGTH];
+    getHistoryPath(slot, path);
+
+    File file = LittleFS.open(path, "r");
+    if (!file)
+      continue;
+
+    historyBlock header;
+    size_t headerSize = offsetof(historyBlock, payload);
+    bool valid = file.read((uint8_t *)&header, headerSize) == headerSize;
+    file.close();
+
+    if (!valid || header.count == 0 || header.length > HISTORY_PAYLOAD_SIZE)
+      continue;
+
+    historyIndex[slot] = header.firstMinute;
+    if (header.lastMinute > historyLastMinute)
+    {
+      historyLastMinute = header.lastMinute;
+      historyHead = (slot + 1) % HISTORY_BLOCKS;
+    }
+  }
+}
+
+void loadTotals()
+{
+  totalsRecord record;
+  memset(&record, 0, sizeof(record));
+  if (!readRecord(TOTALS_FILE, &record, sizeof(record)))
+  {
+    oxrs.println(F("[flow] no saved totals found, starting from zero"));
+    return;
+  }
+
+  totals.baseVolumeMls = record.volumeMls;
+  memcpy(totals.tariffVolumeMls, record.tariffVolumeMls, sizeof(totals.tariffVolumeMls));
+  totals.reverseBaseVolumeMls = record.reverseVolumeMls;
+
+  todayMls = record.todayMls;
+  yesterdayMls = record.yesterdayMls;
+  weekMls = record.weekMls;
+  monthMls = record.monthMls;
+  periodDay = record.periodDay;
+  periodMonth = record.periodMonth;
+  driftRatioQ16 = record.driftRatioQ16;
+  bootCount = record.bootCount;
+
+  oxrs.print(F("[flow] restored total volume (L): "));
+  oxrs.println((uint32_t)(totals.baseVolumeMls / 1000));
+}
+
+void saveTotals()
+{
+  totalsRecord record;
+  record.volumeMls = getTotalVolumeMls();
+  memcpy(record.tariffVolumeMls, totals.tariffVolumeMls, sizeof(totals.tariffVolumeMls));
+  record.reverseVolumeMls = getTotalReverseVolumeMls();
+
+  record.todayMls = todayMls;
+  record.yesterdayMls = yesterdayMls;
+  record.weekMls = weekMls;
+  record.monthMls = monthMls;
+  record.periodDay = periodDay;
+  record.periodMonth = periodMonth;
+  record.driftRatioQ16 = driftRatioQ16;
+  record.bootCount = bootCount;
+
+  if (writeRecord(TOTALS_FILE, &record, sizeof(record)))
+  {
+    totalsDirty = false;
+  }
+}
+
+void getConfigRecord(configRecord * record)
+{
+  // Zero any padding so records compare (and CRC) consistently
+  memset(record, 0, sizeof(configRecord));
+
+  record->telemetryIntervalMs = telemetryIntervalMs;
+  record->kFactor = kFactor;
+  record->zeroFlowTimeoutMs = zeroFlowTimeoutMs;
+  record->frequencyScaleQ16 = frequencyScaleQ16;
+  record->frequencyOffsetMhz = frequencyOffsetMhz;
+  record->referenceKFactor = referenceKFactor;
+  record->driftWindowMls = driftWindowMls;
+  record->driftAlertPermille = driftAlertPermille;
+  record->rateFilterGain = rateFilterGain;
+  record->inputMode = inputMode;
+
+  strlcpy(record->posixTimezone, posixTimezone, sizeof(record->posixTimezone));
+  strlcpy(record->ntpServer, ntpServer, sizeof(record->ntpServer));
+  record->tariffBandCount = tariffBandCount;
+  memcpy(record->tariffBands, tariffBands, sizeof(tariffBands));
+}
+
+void startTime()
+{
+  configTime(posixTimezone, ntpServer);
+}
+
+void setConfigRecord(configRecord * record)
+{
+  // Apply a validated config, only re-deriving anything that has changed
+  telemetryIntervalMs = record->telemetryIntervalMs;
+  zeroFlowTimeoutMs = record->zeroFlowTimeoutMs;
+  frequencyScaleQ16 = record->frequencyScaleQ16;
+  frequencyOffsetMhz = record->frequencyOffsetMhz;
+  driftWindowMls = record->driftWindowMls;
+  driftAlertPermille = record->driftAlertPermille;
+
+  if (record->kFactor != kFactor)
+  {
+    setKFactor(record->kFactor);
+  }
+
+  setReferenceKFactor(record->referenceKFactor);
+  setRateFilterGain(record->rateFilterGain);
+  setInputMode(record->inputMode);
+
+  if (strcmp(record->posixTimezone, posixTimezone) != 0 || strcmp(record->ntpServer, ntpServer) != 0)
+  {
+    strlcpy(posixTimezone, record->posixTimezone, sizeof(posixTimezone));
+    strlcpy(ntpServer, record->ntpServer, sizeof(ntpServer));
+    startTime();
+  }
+
+  tariffBandCount = record->tariffBandCount;
+  memcpy(tariffBands, record->tariffBands, sizeof(tariffBands));
+}
+
+void loadConfig()
+{
+  // Anything a record from an older image doesn't have keeps its default
+  configRecord record;
+  getDefaultConfigRecord(&record);
+  if (readRecord(CONFIG_FILE, &record, sizeof(record)))
+  {
+    // Re-check every limit, in case they have tightened since it was saved 
+    // (or the record is from an image with a bug), jsonConfig() rejects 
+    // anything out of range so a record it built is never changed by this
+    constrainConfigRecord(&record);
+
+    oxrs.print(F("[flow] restored config, k-factor: "));
+    oxrs.println(record.kFactor);
+  }
+  else
+  {
+    oxrs.println(F("[flow] no saved config found, using defaults"));
+  }
+
+  // Also initialises anything derived from the config, e.g. the reciprocals
+  setConfigRecord(&record);
+  getConfigRecord(&savedConfig);
+}
+
+void saveConfig()
+{
+  configRecord record;
+  getConfigRecord(&record);
+
+  if (memcmp(&record, &savedConfig, sizeof(record)) == 0)
+    return;
+
+  if (writeRecord(CONFIG_FILE, &record, sizeof(record)))
+  {
+    savedConfig = record;
+  }
+}
+
+void checkSaveTotals()
+{
+  // Limit flash writes, the totals only need to survive a reboot
+  if (!totalsDirty || (millis() - lastTotalsSaveMs) < TOTALS_SAVE_INTERVAL_MS)
+    return;
+
+  lastTotalsSaveMs = millis();
+  saveTotals();
+  saveHistory();
+}
+
+void checkPeriods()
+{
+  if ((millis() - lastPeriodCheckMs) < PERIOD_CHECK_INTERVAL_MS)
+    return;
+
+  lastPeriodCheckMs = millis();
+  rollPeriods();
+}
+
+void publishConsumption()
+{
+  // Publish changes at a slow cadence, as retained values for dashboards
+  if (!consumptionDirty || (millis() - lastConsumptionMs) < CONSUMPTION_PUBLISH_INTERVAL_MS)
+    return;
+
+  StaticJsonDocument<128> json;
+  json["todayMls"] = todayMls;
+  json["yesterdayMls"] = yesterdayMls;
+  json["weekMls"] = weekMls;
+  json["monthMls"] = monthMls;
+
+  publishOutput(OUTPUT_CONSUMPTION, json, true);
+}
+
+void publishTotals()
+{
+  // Publish changes at a slow cadence, as retained values so new subscribers
+  // get the current totals straight away (telemetry windows are deltas)
+  if (!totalsPublishDirty || (millis() - lastTotalsPublishMs) < TOTALS_PUBLISH_INTERVAL_MS)
+    return;
+
+  StaticJsonDocument<256> json;
+  json["boot"] = bootCount;
+  json["totalVolumeMls"] = getTotalVolumeMls();
+  if (inputMode == INPUT_MODE_QUADRATURE)
+  {
+    json["totalReverseVolumeMls"] = getTotalReverseVolumeMls();
+  }
+
+  JsonArray tariffVolumes = json.createNestedArray("tariffVolumeMls");
+  for (uint8_t i = 0; i <= tariffBandCount; i++)
+  {
+    tariffVolumes.add(totals.tariffVolumeMls[i]);
+  }
+
+  publishOutput(OUTPUT_TOTALS, json, true);
+}
+
+bool isTelemetryFieldApplicable(uint8_t field)
+{
+  switch (field)
+  {
+    case FIELD_RATE_CHANGE:
+      return inputMode != INPUT_MODE_FREQUENCY;
+    case FIELD_FREQUENCY:
+      return inputMode == INPUT_MODE_FREQUENCY;
+    case FIELD_REVERSE_PULSES:
+    case FIELD_REVERSE_VOLUME:
+    case FIELD_NET_VOLUME:
+    case FIELD_TOTAL_REVERSE:
+    case FIELD_TOTAL_NET:
+      return inputMode == INPUT_MODE_QUADRATURE;
+    case FIELD_REFERENCE_VOLUME:
+    case FIELD_DRIFT:
+      return inputMode == INPUT_MODE_PULSE && referenceKFactor > 0;
+    case FIELD_RESENDS:
+      return ackTimeoutMs > 0L;
+  }
+  return true;
+}
+
+void buildTelemetryFields()
+{
+  // Resolve the mask (and input mode) into a flat list once, so the 
+  // serializer just walks the list for each window
+  telemetryFieldCount = 0;
+  for (uint8_t field = 0; field < FIELD_COUNT; field++)
+  {
+    if ((telemetryFieldMask & (1UL << field)) && isTelemetryFieldApplicable(field))
+    {
+      telemetryFieldList[telemetryFieldCount++] = field;
+    }
+  }
+}
+
+const char * getFieldKey(uint8_t field)
+{
+  return FIELD_KEYS[field][shortKeys ? 1 : 0];
+}
+
+void jsonConfig(JsonVariant json)
+{
+  // What is in use now, to tell whether this config changes anything
+  configRecord previous;
+  getConfigRecord(&previous);
+  uint32_t previousFieldMask = telemetryFieldMask;
+  bool previousEnvelopeMode = envelopeMode;
+  bool previousShortKeys = shortKeys;
+
+  // Measurement config is checked as a whole (see FlowConfig.h), anything 
+  // invalid is rejected and keeps its previous value rather than being 
+  // clamped, so a bad payload can never zero the k-factor or interval
+  configRecord record = previous;
+  uint8_t rejected = parseMeasurementConfig(json, &record);
+  setConfigRecord(&record);
+
+  rejected += parseOutputConfig(json, &telemetryFieldMask, &envelopeMode, &shortKeys);
+
+  // Discovery value templates reference our keys
+  if (shortKeys != previousShortKeys)
+  {
+    hassDiscoveryPublished = false;
+  }
+
+  uint32_t batchIntervalMins;
+  if (readConfigInt(json, "batchIntervalMins", 0, BATCH_INTERVAL_MINS_MAX, &batchIntervalMins, &rejected))
+  {
+    batchIntervalMs = batchIntervalMins * 60000L;
+  }
+
+  uint32_t ackTimeoutSecs;
+  if (readConfigInt(json, "ackTimeoutSecs", 0, ACK_TIMEOUT_SECS_MAX, &ackTimeoutSecs, &rejected))
+  {
+    ackTimeoutMs = ackTimeoutSecs * 1000L;
+  }
+
+  uint32_t histogramIntervalMins;
+  if (readConfigInt(json, "histogramIntervalMins", 0, HISTOGRAM_INTERVAL_MINS_MAX, &histogramIntervalMins, &rejected))
+  {
+    histogramIntervalMs = histogramIntervalMins * 60000L;
+  }
 
-// Pulse count/telemetry variables
-uint32_t  pulseCount                    = 0L;
-uint32_t  lastTelemetryMs               = 0L;
-uint32_t  elapsedTelemetryMs            = 0L;
+  readConfigInt(json, "captureRateStepMlsPerMin", 0, CAPTURE_RATE_STEP_MAX, &captureRateStepMlsPerMin, &rejected);
+  readConfigInt(json, "anomalySigma", 0, ANOMALY_SIGMA_MAX, &anomalySigma, &rejected);
 
-// Publish Home Assistant self-discovery config for each sensor
-bool      hassDiscoveryPublished        = false;
+  if (rejected > 0)
+  {
+    oxrs.print(F("[flow] invalid config values ignored: "));
+    oxrs.println(rejected);
+  }
 
-/*--------------------------- Instantiate Globals ---------------------*/
-// home assistant discovery config
-OXRS_HASS hass(oxrs.getMQTT());
+  // Anything measured so far this window used the old config, but only if
+  // it really changed (the same config is re-sent on every reconnect)
+  configRecord applied;
+  getConfigRecord(&applied);
+  if (memcmp(&applied, &previous, sizeof(configRecord)) != 0 ||
+      telemetryFieldMask != previousFieldMask || envelopeMode != previousEnvelopeMode)
+  {
+    windowQuality |= QUALITY_CONFIG_CHANGED;
+  }
 
-/*--------------------------- Program ---------------------------------*/
-void IRAM_ATTR isr() 
+  // Topics depend on the MQTT client config, which may have changed
+  buildTopics();
+
+  // Fields depend on the input mode and reference meter as well as the mask
+  buildTelemetryFields();
+
+  // Persist anything which affects measurement, for use from the next boot
+  saveConfig();
+
+  // Handle any Home Assistant config
+  hass.parseConfig(json);
+}
+
+uint32_t addHistoryRows(historyBlock * block, uint32_t fromMinute, uint32_t toMinute, JsonArray timestamps, JsonArray volumes)
 {
-  pulseCount++;
+  uint32_t minute = block->firstMinute;
+  int32_t volumeMls = 0L;
+  uint16_t position = 0;
+
+  for (uint16_t i = 0; i < block->count; i++)
+  {
+    minute += readVarint(block->payload, &position, block->length);
+    uint32_t zigzag = readVarint(block->payload, &position, block->length);
+    volumeMls += (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+
+    if (minute < fromMinute)
+      continue;
+
+    // Stop at the end of the range, or where the next page should start
+    if (minute > toMinute)
+      return 0L;
+
+    if (timestamps.size() >= HISTORY_QUERY_ROWS_MAX)
+      return minute;
+
+    timestamps.add(minute * 60);
+    volumes.add(volumeMls);
+  }
+
+  return 0L;
 }
 
-void setConfigSchema()
+void queryHistory(uint32_t from, uint32_t to)
 {
-  // Define our config schema
-  StaticJsonDocument<1024> json;
-  
-  JsonObject telemetryIntervalMs = json.createNestedObject("telemetryIntervalMs");
-  telemetryIntervalMs["title"] = "Telemetry Interval (ms)";
-  telemetryIntervalMs["description"] = "How often to publish telemetry data (defaults to 1000ms, i.e. 1 second)";
-  telemetryIntervalMs["type"] = "integer";
-  telemetryIntervalMs["minimum"] = 1;
-  telemetryIntervalMs["maximum"] = TELEMETRY_INTERVAL_MS_MAX;
+  uint32_t fromMinute = from / 60;
+  uint32_t toMinute = to / 60;
 
-  JsonObject kFactor = json.createNestedObject("kFactor");
-  kFactor["title"] = "K-Factor";
-  kFactor["description"] = "Number of pulses per litre (defaults to 49, check flow sensor specs)";
-  kFactor["type"] = "integer";
-  kFactor["minimum"] = 1;
-  kFactor["maximum"] = K_FACTOR_MAX;
+  DynamicJsonDocument json(4096);
+  json["from"] = from;
+  json["to"] = to;
+  JsonArray timestamps = json.createNestedArray("timestamps");
+  JsonArray volumes = json.createNestedArray("volumesMls");
 
-  // Add any Home Assistant config
-  hass.setConfigSchema(json);
+  // Walk the blocks oldest first, only reading those which overlap the range
+  uint32_t nextMinute = 0L;
+  for (uint16_t i = 0; i < HISTORY_BLOCKS && nextMinute == 0L; i++)
+  {
+    uint16_t slot = (historyHead + i) % HISTORY_BLOCKS;
+    if (historyIndex[slot] == 0L)
+      continue;
 
-  // Pass our config schema down to the Room8266 library
-  oxrs.setConfigSchema(json.as<JsonVariant>());
+    // The head slot may hold a saved copy of the block still in RAM
+    if (slot == historyHead && historyBuffer.count > 0 && historyIndex[slot] == historyBuffer.firstMinute)
+      continue;
+
+    if (historyIndex[slot] > toMinute)
+      break;
+
+    // A block ends before the next one (or the one in RAM) starts
+    uint32_t endMinute = historyBuffer.count > 0 ? historyBuffer.firstMinute : UINT32_MAX;
+    for (uint16_t j = i + 1; j < HISTORY_BLOCKS; j++)
+    {
+      uint16_t next = (historyHead + j) % HISTORY_BLOCKS;
+      if (historyIndex[next] != 0L)
+      {
+        endMinute = historyIndex[next];
+        break;
+      }
+    }
+
+    if (endMinute <= fromMinute)
+      continue;
+
+    char path[HISTORY_PATH_MAX_LENGTH];
+    getHistoryPath(slot, path);
+
+    File file = LittleFS.open(path, "r");
+    if (!file)
+      continue;
+
+    historyBlock block;
+    bool valid = file.read((uint8_t *)&block, HISTORY_BLOCK_SIZE) == HISTORY_BLOCK_SIZE;
+    file.close();
+
+    if (!valid || block.length > HISTORY_PAYLOAD_SIZE || block.crc != getHistoryCrc(&block))
+      continue;
+
+    nextMinute = addHistoryRows(&block, fromMinute, toMinute, timestamps, volumes);
+  }
+
+  // Then anything not yet written to flash
+  if (nextMinute == 0L && historyBuffer.count > 0)
+  {
+    nextMinute = addHistoryRows(&historyBuffer, fromMinute, toMinute, timestamps, volumes);
+  }
+
+  if (nextMinute != 0L)
+  {
+    json["next"] = nextMinute * 60;
+  }
+
+  publishTopic(TOPIC_HISTORY, json, false);
 }
 
-void jsonConfig(JsonVariant json)
+void jsonCommand(JsonVariant json)
 {
-  if (json.containsKey("telemetryIntervalMs"))
+  if (json.containsKey("historyQuery"))
   {
-    telemetryIntervalMs = min(json["telemetryIntervalMs"].as<int>(), TELEMETRY_INTERVAL_MS_MAX);
+    JsonVariant query = json["historyQuery"];
+    queryHistory(query["from"] | 0UL, query["to"] | (unsigned long)UINT32_MAX);
   }
 
-  if (json.containsKey("kFactor"))
+  if (json.containsKey("ack"))
   {
-    kFactor = min(json["kFactor"].as<int>(), K_FACTOR_MAX);
+    JsonVariant ack = json["ack"];
+    if (ack["boot"].is<uint32_t>() && ack["seq"].is<uint32_t>())
+    {
+      ackWindows(ack["boot"].as<uint32_t>(), ack["seq"].as<uint32_t>());
+    }
   }
+}
 
-  // Handle any Home Assistant config
-  hass.parseConfig(json);
+void closeWindow(telemetryWindow * window, uint32_t elapsedMs)
+{
+  // Snapshot the counts, the ISRs can keep incrementing while we publish
+  noInterrupts();
+  window->pulseCount = pulseCount;
+  window->reversePulseCount = reversePulseCount;
+  window->referencePulseCount = referencePulseCount;
+  window->edgeMicros = frequencyEdgeMicros;
+  window->edgeOverflowCount = edgeBuffer.overflowCount - windowOverflowBase;
+  interrupts();
+
+  // Make sure this window lands in the right day
+  rollPeriods();
+
+  // Quality flags raised while this window was open
+  window->boot = bootCount;
+  window->seq = windowSeq;
+  window->firstSeq = windowSeq;
+  window->quality = windowQuality;
+
+  // Frequency windows are measured by reciprocal counting, which doesn't
+  // need every edge timed, so a full buffer is expected at high frequencies
+  if (window->edgeOverflowCount > 0 && inputMode != INPUT_MODE_FREQUENCY)
+  {
+    window->quality |= QUALITY_OVERFLOW;
+  }
+
+  if (!isTimeValid())
+  {
+    window->quality |= QUALITY_CLOCK_UNSYNCED;
+  }
+
+  window->timestamp = isTimeValid() ? time(NULL) : 0L;
+  window->elapsedMs = elapsedMs;
+  window->tariffBand = getTariffBand();
+
+  if (inputMode == INPUT_MODE_FREQUENCY)
+  {
+    // Frequency meters measure rate, so volume is the rate over the window
+    window->frequencyMhz = getFrequencyMhz(window->pulseCount, window->edgeMicros, elapsedMs);
+
+    uint32_t rateMlsPerMin = getFrequencyRateMlsPerMin(window->frequencyMhz);
+    window->rateMlsPerMin = min(rateMlsPerMin, (uint32_t)INT32_MAX);
+    window->rateChangeMlsPerMin = 0L;
+    window->volumeMls = rateToVolumeMls(rateMlsPerMin, elapsedMs);
+  }
+  else
+  {
+    window->frequencyMhz = 0L;
+    window->volumeMls = getVolumeMls(window->pulseCount);
+
+    // Rate is signed for quadrature meters, negative when flowing in reverse
+    uint32_t rateMlsPerMin = getRateMlsPerMin();
+    int8_t rateSign = (inputMode == INPUT_MODE_QUADRATURE && reverseFlow) ? -1 : 1;
+    window->rateMlsPerMin = rateSign * (int32_t)min(rateMlsPerMin, (uint32_t)INT32_MAX);
+    window->rateChangeMlsPerMin = rateSign * getRateChangeMlsPerMin(rateMlsPerMin);
+  }
+
+  window->reverseVolumeMls = getVolumeMls(window->reversePulseCount);
+
+  window->referenceVolumeMls = referenceKFactor > 0 
+    ? pulsesToMls(window->referencePulseCount, referenceReciprocal, referenceKFactor) 
+    : 0L;
+}
+
+template <typename T>
+void setField(T value, uint8_t field, telemetryWindow * window)
+{
+  switch (field)
+  {
+    case FIELD_SEQ:               value.set(window->seq); break;
+    case FIELD_TIMESTAMP:         value.set(window->timestamp); break;
+    case FIELD_ELAPSED:           value.set(window->elapsedMs); break;
+    case FIELD_PULSES:            value.set(window->pulseCount); break;
+    case FIELD_VOLUME:            value.set(window->volumeMls); break;
+    case FIELD_RATE:              value.set(window->rateMlsPerMin); break;
+    case FIELD_RATE_CHANGE:       value.set(window->rateChangeMlsPerMin); break;
+    case FIELD_FREQUENCY:         value.set(window->frequencyMhz); break;
+    case FIELD_QUALITY:           value.set(window->quality); break;
+    case FIELD_OVERFLOW:          value.set(window->edgeOverflowCount); break;
+    case FIELD_REVERSE_PULSES:    value.set(window->reversePulseCount); break;
+    case FIELD_REVERSE_VOLUME:    value.set(window->reverseVolumeMls); break;
+    case FIELD_NET_VOLUME:        value.set((int64_t)window->volumeMls - window->reverseVolumeMls); break;
+    case FIELD_REFERENCE_VOLUME:  value.set(window->referenceVolumeMls); break;
+    case FIELD_FIRST_SEQ:         value.set(window->firstSeq); break;
+    case FIELD_BOOT:              value.set(window->boot); break;
+    case FIELD_TOTAL_VOLUME:      value.set(window->totalVolumeMls); break;
+    case FIELD_TOTAL_REVERSE:     value.set(window->totalReverseVolumeMls); break;
+    case FIELD_TOTAL_NET:         value.set((int64_t)(window->totalVolumeMls - window->totalReverseVolumeMls)); break;
+    case FIELD_DRIFT:             value.set(driftRatioQ16 ? getDriftPermille() : 0); break;
+    case FIELD_PUBLISH_FAILURES:  value.set(telemetryPublishFailures); break;
+    case FIELD_RESENDS:           value.set(windowResends); break;
+
+    case FIELD_TARIFF:
+    {
+      // Time-of-use totals as of this window
+      JsonArray tariffVolumes = value.template to<JsonArray>();
+      for (uint8_t i = 0; i <= tariffBandCount; i++)
+      {
+        tariffVolumes.add(window->tariffVolumeMls[i]);
+      }
+      break;
+    }
+  }
+}
+
+void addTelemetryJson(JsonVariant json, telemetryWindow * window, bool windowFields)
+{
+  for (uint8_t i = 0; i < telemetryFieldCount; i++)
+  {
+    uint8_t field = telemetryFieldList[i];
+    if (windowFields || field >= FIELD_MESSAGE_FIRST)
+    {
+      setField(json[getFieldKey(field)], field, window);
+    }
+  }
+}
+
+void publishWindow()
+{
+  if (windowQueue.count <= sentWindowCount || sentWindowCount >= ACK_WINDOW_MAX || isPublishBackingOff())
+    return;
+
+  // Oldest unsent first, each window stays queued until it has gone out 
+  // (and been acked, if enabled)
+  StaticJsonDocument<512> json;
+  addTelemetryJson(json.as<JsonVariant>(), &windowQueue.windows[sentWindowCount], true);
+
+  if (!publishOutput(OUTPUT_TELEMETRY, json, false) && !envelopeMode)
+  {
+    retryWindows();
+  }
+}
+
+void queueWindow(telemetryWindow * window)
+{
+  // Windows are committed as they close, so are billed to the band, day 
+  // and hour they were measured in however late they are published, and 
+  // the totals are exact even if we lose the per-window detail
+  commitWindow(window);
+
+  // Making room merges queued windows, which may mix sent and unsent ones,
+  // so anything waiting for an ack is sent again as merged
+  if (windowQueue.count >= BATCH_WINDOW_MAX && sentWindowCount > 0)
+  {
+    resendWindows();
+  }
+  mergedWindowCount += queueWindow(&windowQueue, window);
+}
+
+void publishBatch()
+{
+  // A batch waiting for its ack is only sent again once that times out
+  if (windowQueue.count == 0 || sentWindowCount > 0 || isPublishBackingOff())
+    return;
+
+  // Upload when the batch interval is up, or sooner if the queue holds 
+  // windows replayed from before an update (a full queue is merged instead)
+  if ((millis() - lastBatchMs) < batchIntervalMs && windowQueue.windows[0].boot == bootCount)
+    return;
+
+  // The boot field is per message, so never mix windows from two boots
+  batchWindowCount = 1;
+  while (batchWindowCount < windowQueue.count && windowQueue.windows[batchWindowCount].boot == windowQueue.windows[0].boot)
+  {
+    batchWindowCount++;
+  }
+
+  DynamicJsonDocument json(BATCH_JSON_SIZE);
+
+  // Rows are positional to keep the payload compact, always starting 
+  // with seq and timestamp, followed by any other selected window fields
+  JsonArray fields = json.createNestedArray("fields");
+  fields.add(getFieldKey(FIELD_SEQ));
+  fields.add(getFieldKey(FIELD_TIMESTAMP));
+  for (uint8_t i = 0; i < telemetryFieldCount; i++)
+  {
+    uint8_t field = telemetryFieldList[i];
+    if (field > FIELD_TIMESTAMP && field < FIELD_MESSAGE_FIRST)
+    {
+      fields.add(getFieldKey(field));
+    }
+  }
+
+  JsonArray windows = json.createNestedArray("windows");
+  for (uint8_t i = 0; i < batchWindowCount; i++)
+  {
+    telemetryWindow * window = &windowQueue.windows[i];
+
+    JsonArray row = windows.createNestedArray();
+    row.add(window->seq);
+    row.add(window->timestamp);
+    for (uint8_t j = 0; j < telemetryFieldCount; j++)
+    {
+      uint8_t field = telemetryFieldList[j];
+      if (field > FIELD_TIMESTAMP && field < FIELD_MESSAGE_FIRST)
+      {
+        setField(row.add(), field, window);
+      }
+    }
+  }
+
+  // Totals are as of the latest window in this batch (already committed)
+  addTelemetryJson(json.as<JsonVariant>(), &windowQueue.windows[batchWindowCount - 1], false);
+  json["mergedWindows"] = mergedWindowCount;
+
+  if (!publishOutput(OUTPUT_BATCH, json, false) && !envelopeMode)
+  {
+    retryWindows();
+  }
+}
+
+void saveUpdateCarry()
+{
+  updateCarryRecord carry;
+  carry.size = sizeof(updateCarryRecord) - offsetof(updateCarryRecord, size);
+  carry.bootCount = bootCount;
+  carry.windowCount = windowQueue.count;
+
+  noInterrupts();
+  carry.pulseCount = pulseCount;
+  carry.reversePulseCount = reversePulseCount;
+  carry.referencePulseCount = referencePulseCount;
+  interrupts();
+
+  carry.crc = crc32((uint8_t *)&carry.size, carry.size);
+  ESP.rtcUserMemoryWrite(UPDATE_CARRY_RTC_BLOCK, (uint32_t *)&carry, sizeof(carry));
+}
+
+bool readUpdateCarry(updateCarryRecord * carry)
+{
+  uint32_t words[UPDATE_CARRY_RTC_WORDS];
+  if (!ESP.rtcUserMemoryRead(UPDATE_CARRY_RTC_BLOCK, words, sizeof(words)))
+    return false;
+
+  // Fields the writing image didn't have are left zeroed
+  memset(carry, 0, sizeof(updateCarryRecord));
+
+  size_t size = words[1];
+  if (size >= sizeof(uint32_t) && size < sizeof(words) && words[0] == crc32((uint8_t *)&words[1], size))
+  {
+    memcpy(&carry->size, &words[1], min(size, sizeof(updateCarryRecord) - offsetof(updateCarryRecord, size)));
+    return true;
+  }
+
+  return false;
+}
+
+void clearUpdateCarry()
+{
+  updateCarryRecord carry;
+  memset(&carry, 0, sizeof(carry));
+  ESP.rtcUserMemoryWrite(UPDATE_CARRY_RTC_BLOCK, (uint32_t *)&carry, sizeof(carry));
+}
+
+void flushForUpdate()
+{
+  // Close the current window early and queue it, which commits it to the
+  // totals, so it survives the restart with anything already queued
+  windowQuality |= QUALITY_PARTIAL;
+
+  telemetryWindow window;
+  closeWindow(&window, millis() - lastTelemetryMs);
+  queueWindow(&window);
+
+  saveTotals();
+  saveHistory();
+  writeRecords(REPLAY_FILE, windowQueue.windows, sizeof(telemetryWindow), windowQueue.count);
+
+  oxrs.print(F("[flow] update started, windows flushed: "));
+  oxrs.println(windowQueue.count);
+}
+
+void updateProgress(size_t, size_t)
+{
+  // Called from the OTA handler as each chunk of the new image is written
+  if (!updateFlushed)
+  {
+    flushForUpdate();
+    updateFlushed = true;
+  }
+
+  // Keep the carried over counts current, the restart follows the last chunk
+  saveUpdateCarry();
+}
+
+void checkUpdateAborted()
+{
+  if (!updateFlushed || Update.isRunning())
+    return;
+
+  // Update failed so we carry on counting, make sure the carried over 
+  // counts can't be added again if we restart for some other reason
+  updateFlushed = false;
+  clearUpdateCarry();
+  LittleFS.remove(REPLAY_FILE);
+}
+
+void restoreUpdateState()
+{
+  // Only trust the carry if it was written by the boot we just restored
+  updateCarryRecord carry;
+  bool valid = readUpdateCarry(&carry) &&
+    carry.bootCount == bootCount &&
+    carry.windowCount <= BATCH_WINDOW_MAX;
+
+  if (valid)
+  {
+    noInterrupts();
+    pulseCount += carry.pulseCount;
+    reversePulseCount += carry.reversePulseCount;
+    referencePulseCount += carry.referencePulseCount;
+#if defined(PULSE_CONSERVATION_CHECK)
+    shadowPulseCount += carry.pulseCount;
+#endif
+    interrupts();
+
+    // Queued windows were committed before the update, so only need 
+    // sending, any fields the old image didn't have read as zero (or for 
+    // tariff totals, which it did keep, as they stand now, and for the 
+    // first seq, as if unmerged)
+    for (uint8_t i = 0; i < carry.windowCount; i++)
+    {
+      memset(&windowQueue.windows[i], 0, sizeof(telemetryWindow));
+      memcpy(windowQueue.windows[i].tariffVolumeMls, totals.tariffVolumeMls, sizeof(totals.tariffVolumeMls));
+      windowQueue.windows[i].firstSeq = UINT32_MAX;
+    }
+
+    windowQueue.count = readRecords(REPLAY_FILE, windowQueue.windows, sizeof(telemetryWindow), carry.windowCount);
+    for (uint8_t i = 0; i < windowQueue.count; i++)
+    {
+      telemetryWindow * window = &windowQueue.windows[i];
+      window->quality |= QUALITY_REPLAYED;
+      window->firstSeq = min(window->firstSeq, window->seq);
+    }
+
+#if defined(PULSE_CONSERVATION_CHECK)
+    // Counted before the update, but still to be published from this boot
+    uint32_t replayedPulses = getQueuedPulseCount(windowQueue.count);
+    noInterrupts();
+    shadowPulseCount += replayedPulses;
+    interrupts();
+#endif
+
+    // The first window includes pulses counted while the update was written
+    windowQuality |= QUALITY_UPDATED;
+
+    oxrs.print(F("[flow] restored state across update, windows replayed: "));
+    oxrs.println(windowQueue.count);
+  }
+
+  clearUpdateCarry();
+  LittleFS.remove(REPLAY_FILE);
 }
 
 void publishHassDiscovery()
@@ -96,26 +2747,101 @@ void publishHassDiscovery()
   if (hassDiscoveryPublished)
     return;
 
-  char topic[64];
-
-  char component[8];
+  char component[16];
   sprintf_P(component, PSTR("sensor"));
 
-  char id[8];
+  char id[16];
   sprintf_P(id, PSTR("flow"));
 
+  char valueTemplate[48];
+
   DynamicJsonDocument json(1024);
   hass.getDiscoveryJson(json, id);
 
   json["name"]  = "Flow Sensor";
   json["dev_cla"] = "water";
   json["unit_of_meas"] = "L";
-  json["stat_t"] = oxrs.getMQTT()->getTelemetryTopic(topic);
-  json["val_tpl"] = "{{ value_json.volumeMls / 1000 }}";
+  json["stat_t"] = topics[TOPIC_TELEMETRY];
+  sprintf_P(valueTemplate, PSTR("{{ value_json.%s / 1000 }}"), getFieldKey(FIELD_VOLUME));
+  json["val_tpl"] = valueTemplate;
   json["frc_upd"] = true;
 
+  if (!hass.publishDiscoveryJson(json, component, id))
+    return;
+
+  sprintf_P(id, PSTR("flowrate"));
+
+  json.clear();
+  hass.getDiscoveryJson(json, id);
+
+  json["name"]  = "Flow Rate";
+  json["unit_of_meas"] = "L/min";
+  json["stat_t"] = topics[TOPIC_TELEMETRY];
+  sprintf_P(valueTemplate, PSTR("{{ value_json.%s / 1000 }}"), getFieldKey(FIELD_RATE));
+  json["val_tpl"] = valueTemplate;
+
+  if (!hass.publishDiscoveryJson(json, component, id))
+    return;
+
+  if (inputMode == INPUT_MODE_FREQUENCY)
+  {
+    sprintf_P(id, PSTR("flowfreq"));
+
+    json.clear();
+    hass.getDiscoveryJson(json, id);
+
+    json["name"]  = "Frequency";
+    json["dev_cla"] = "frequency";
+    json["unit_of_meas"] = "Hz";
+    json["stat_t"] = topics[TOPIC_TELEMETRY];
+    sprintf_P(valueTemplate, PSTR("{{ value_json.%s / 1000 }}"), getFieldKey(FIELD_FREQUENCY));
+    json["val_tpl"] = valueTemplate;
+
+    if (!hass.publishDiscoveryJson(json, component, id))
+      return;
+  }
+
+  sprintf_P(component, PSTR("binary_sensor"));
+  sprintf_P(id, PSTR("flowing"));
+
+  json.clear();
+  hass.getDiscoveryJson(json, id);
+
+  json["name"]  = "Flowing";
+  json["dev_cla"] = "running";
+  json["stat_t"] = topics[TOPIC_STATUS];
+  json["val_tpl"] = "{% if value_json.event == 'flowStarted' %}ON{% elif value_json.event == 'flowStopped' %}OFF{% endif %}";
+
+  if (!hass.publishDiscoveryJson(json, component, id))
+    return;
+
+  // Consumption per calendar period
+  const char * periods[] = { "today", "yesterday", "week", "month" };
+  const char * names[] = { "Today", "Yesterday", "This Week", "This Month" };
+
+  sprintf_P(component, PSTR("sensor"));
+
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    sprintf_P(id, PSTR("flow%s"), periods[i]);
+
+    json.clear();
+    hass.getDiscoveryJson(json, id);
+
+    sprintf_P(valueTemplate, PSTR("{{ value_json.%sMls / 1000 }}"), periods[i]);
+
+    json["name"]  = names[i];
+    json["dev_cla"] = "water";
+    json["unit_of_meas"] = "L";
+    json["stat_t"] = topics[TOPIC_CONSUMPTION];
+    json["val_tpl"] = valueTemplate;
+
+    if (!hass.publishDiscoveryJson(json, component, id))
+      return;
+  }
+
   // Only publish once on boot
-  hassDiscoveryPublished = hass.publishDiscoveryJson(json, component, id);
+  hassDiscoveryPublished = true;
 }
 
 /**
@@ -128,22 +2854,45 @@ void setup()
   delay(1000);
   Serial.println(F("[flow] starting up..."));
 
-  // Enable internal pullup on our sensor pin
-  pinMode(I2C_SDA, INPUT_PULLUP);
+  // Restore the last applied measurement config before we start counting,
+  // so the first windows are measured correctly even without a broker
+  LittleFS.begin();
+  loadConfig();
+
+  // Attach our interrupt service routines for the input mode
+  attachInputs();
+
+  // Restore our totals from flash, and count this boot straight away so 
+  // window sequence numbers are never reused
+  loadTotals();
+  loadBaseline();
+  loadHistory();
+  restoreUpdateState();
+  bootCount++;
+  saveTotals();
 
-  // Setup the sensor pin to trigger our interrupt service routine when 
-  // pin goes from HIGH to LOW, i.e. FALLING edge
-  attachInterrupt(I2C_SDA, isr, FALLING);
+  // Flush our state to flash when an OTA update starts
+  Update.onProgress(updateProgress);
 
   // Log the pin we are monitoring for pulse events
   oxrs.print(F("[flow] pulse sensor pin: "));
   oxrs.println(I2C_SDA);
+  oxrs.print(F("[flow] reference/phase B sensor pin: "));
+  oxrs.println(REFERENCE_PIN);
 
   // Start Room8266 hardware
-  oxrs.begin(jsonConfig, NULL);
+  oxrs.begin(jsonConfig, jsonCommand);
 
-  // Set up config schema (for self-discovery and adoption)
+  // Build our MQTT topics from the initial client config
+  buildTopics();
+  buildTelemetryFields();
+
+  // Set up config and command schemas (for self-discovery and adoption)
   setConfigSchema();
+  setCommandSchema();
+
+  // Start syncing local time (for tariff bands)
+  startTime();
 }
 
 /**
@@ -154,24 +2903,70 @@ void loop()
   // Let Room8266 hardware handle any events etc
   oxrs.loop();
 
-  // Check if we need to send telemetry
+  // Feed any new pulse edges into the rate tracker
+  processEdges();
+
+  // Drop the rate to zero once pulses have stopped arriving
+  checkZeroFlow();
+
+  // Publish any flow start/stop event straight away
+  publishFlowEvent();
+
+  // Check if we need to close the current telemetry window
   elapsedTelemetryMs = millis() - lastTelemetryMs;
   if (elapsedTelemetryMs >= telemetryIntervalMs)
   {
-    // Build telemetry payload
-    StaticJsonDocument<128> json;
-    json["elapsedMs"] = elapsedTelemetryMs;
-    json["pulseCount"] = pulseCount;
-    json["volumeMls"] = (uint32_t)(pulseCount * 1000 / kFactor);
-    
-    // Publish telemetry and reset loop variables if successful
-    if (oxrs.publishTelemetry(json))
-    {
-      lastTelemetryMs = millis();
-      pulseCount = 0;
-    }
+    telemetryWindow window;
+    closeWindow(&window, elapsedTelemetryMs);
+    queueWindow(&window);
   }
 
+  // Publish any queued windows, either one at a time or as a batch, 
+  // starting again from the oldest if still waiting for an ack
+  checkAckTimeout();
+  if (batchIntervalMs > 0L)
+  {
+    publishBatch();
+  }
+  else
+  {
+    publishWindow();
+  }
+
+#if defined(PULSE_CONSERVATION_CHECK)
+  // Verify no pulses have been lost between the ISR and telemetry
+  checkPulseConservation();
+#endif
+
+  // Record fine-grained rate samples around any flow anomaly
+  sampleCapture();
+  publishCapture();
+
+  // Publish any K-factor drift alert
+  publishDriftEvent();
+
+  // Publish the last hour scored against the learnt baseline (if enabled)
+  publishAnomaly();
+
+  // Publish the pulse interval histogram (if enabled)
+  publishHistogram();
+
+  // Roll daily/weekly/monthly consumption at local midnight
+  checkPeriods();
+  publishConsumption();
+
+  // Publish the running totals as a retained last value
+  publishTotals();
+
+  // Send everything produced this pass in one message (if enabled)
+  publishEnvelope();
+
+  // Periodically persist our totals
+  checkSaveTotals();
+
+  // Resume normally if an OTA update failed part way
+  checkUpdateAborted();
+
   // Check if we need to publish any Home Assistant discovery payloads
   if (hass.isDiscoveryEnabled())
   {
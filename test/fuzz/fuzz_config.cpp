@@ -0,0 +1,243 @@
+/**
+  libFuzzer target for the flow sensor config parsing and measurement maths
+
+  Input is a config JSON payload, then a NUL, then a script of pulse windows
+  (two bytes of pulses/frequency, one of elapsed time, one of flags per window).
+  Run with "pio run -e native-fuzz -t fuzz", any failed check aborts with the
+  input.
+*/
+
+#include <stdlib.h>
+#include <FlowConfig.h>
+
+#define   FUZZ_CHECK(condition)           do { if (!(condition)) abort(); } while (0)
+
+// Pulses in each window of the script, capped so that each input runs
+// quickly but still pushes a few times the edge buffer
+#define   FUZZ_PULSES_MASK                0x0FFF
+
+// Flag bits in each window of the script, the top four bits are the tariff band
+#define   FUZZ_FLAG_STALL                 0x01
+#define   FUZZ_FLAG_RECONFIGURE           0x02
+#define   FUZZ_FLAG_PUBLISH               0x04
+#define   FUZZ_FLAG_REVERSE               0x08
+
+void checkConfig(const configRecord * record)
+{
+  // Whatever was accepted must already be within limits, i.e. exactly what
+  // loadConfig() would restore, with nothing left to divide by zero
+  configRecord constrained = *record;
+  constrainConfigRecord(&constrained);
+  FUZZ_CHECK(memcmp(record, &constrained, sizeof(configRecord)) == 0);
+
+  FUZZ_CHECK(record->telemetryIntervalMs > 0);
+  FUZZ_CHECK(record->kFactor > 0);
+  FUZZ_CHECK(record->driftWindowMls > 0);
+  FUZZ_CHECK(record->rateFilterGain > 0);
+  FUZZ_CHECK(strlen(record->posixTimezone) < TIMEZONE_MAX_LENGTH);
+  FUZZ_CHECK(strlen(record->ntpServer) < NTP_SERVER_MAX_LENGTH);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+  const uint8_t * script = (const uint8_t *)memchr(data, 0, size);
+  size_t jsonSize = script ? script - data : size;
+  size_t scriptSize = script ? size - jsonSize - 1 : 0;
+  if (script)
+  {
+    script++;
+  }
+
+  // Config apply, anything rejected must keep its previous value
+  configRecord record;
+  getDefaultConfigRecord(&record);
+
+  DynamicJsonDocument json(4096);
+  if (!deserializeJson(json, (const char *)data, jsonSize))
+  {
+    uint8_t rejected = parseMeasurementConfig(json.as<JsonVariant>(), &record);
+    checkConfig(&record);
+
+    // The same payload again must reject the same values and change nothing
+    configRecord applied = record;
+    FUZZ_CHECK(parseMeasurementConfig(json.as<JsonVariant>(), &record) == rejected);
+    FUZZ_CHECK(memcmp(&record, &applied, sizeof(configRecord)) == 0);
+
+    // Output config, only known fields can ever be selected
+    uint32_t fieldMask = DEFAULT_TELEMETRY_FIELD_MASK;
+    bool envelopeMode = false;
+    bool shortKeys = false;
+    rejected = parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys);
+    FUZZ_CHECK((fieldMask >> FIELD_COUNT) == 0);
+
+    uint32_t appliedFieldMask = fieldMask;
+    bool appliedEnvelopeMode = envelopeMode;
+    bool appliedShortKeys = shortKeys;
+    FUZZ_CHECK(parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys) == rejected);
+    FUZZ_CHECK(fieldMask == appliedFieldMask && envelopeMode == appliedEnvelopeMode && shortKeys == appliedShortKeys);
+  }
+
+  // Windows, pulses drive the edge ring, then each window is committed to
+  // the totals and queued with the same functions the firmware uses
+  static edgeRing ring;
+  static telemetryQueue queue;
+  static flowTotals totals;
+  memset((void *)&ring, 0, sizeof(ring));
+  memset(&queue, 0, sizeof(queue));
+  memset(&totals, 0, sizeof(totals));
+
+  bool frequencyMode = record.inputMode == INPUT_MODE_FREQUENCY;
+  int32_t factor = record.kFactor;
+  uint64_t reciprocal = getVolumeReciprocal(factor);
+
+  // Independent running sums to check the totals and queue against
+  uint64_t bankedVolumeMls = 0LL;
+  uint64_t bankedReverseVolumeMls = 0LL;
+  uint64_t frequencyVolumeMls = 0LL;
+  uint64_t totalPulses = 0LL;
+  uint64_t totalReversePulses = 0LL;
+  uint64_t lastTotalMls = 0LL;
+
+  uint64_t pushed = 0LL;
+  uint64_t drained = 0LL;
+  uint64_t queuedVolumeMls = 0LL;
+  uint64_t queuedPulses = 0LL;
+  uint64_t publishedVolumeMls = 0LL;
+  uint64_t publishedPulses = 0LL;
+  uint32_t now = 0L;
+  uint32_t seq = 0L;
+
+  for (size_t i = 0; i + 4 <= scriptSize; i += 4)
+  {
+    uint32_t value = script[i] | (script[i + 1] << 8);
+    uint32_t pulses = value & FUZZ_PULSES_MASK;
+    uint32_t elapsedMs = script[i + 2] * 10L;
+    uint8_t flags = script[i + 3];
+
+    // A new k-factor banks the totals so far, as setKFactor() does
+    if ((flags & FUZZ_FLAG_RECONFIGURE) && script[i + 2] > 0)
+    {
+      bankTotals(&totals, reciprocal, factor);
+      FUZZ_CHECK(totals.pulseCount == 0 && totals.reversePulseCount == 0);
+      bankedVolumeMls = totals.baseVolumeMls;
+      bankedReverseVolumeMls = totals.reverseBaseVolumeMls;
+      frequencyVolumeMls = 0LL;
+      totalPulses = 0LL;
+      totalReversePulses = 0LL;
+      factor = constrainValue((int32_t)script[i + 2] * 4, (int32_t)1, (int32_t)K_FACTOR_MAX);
+      reciprocal = getVolumeReciprocal(factor);
+    }
+
+    // Pulses spread evenly over the window, the consumer drains them at the
+    // end unless it has stalled
+    uint32_t spacingMicros = pulses > 0 ? elapsedMs * 1000 / pulses : 0;
+    for (uint32_t pulse = 0; pulse < pulses; pulse++)
+    {
+      now += spacingMicros;
+      pushEdge(&ring, now);
+      pushed++;
+    }
+
+    if (!(flags & FUZZ_FLAG_STALL))
+    {
+      uint8_t tail;
+      uint8_t head = peekEdges(&ring, &tail);
+      FUZZ_CHECK((uint8_t)(head - tail) <= EDGE_BUFFER_SIZE);
+      drained += (uint8_t)(head - tail);
+      releaseEdges(&ring, head);
+    }
+
+    // Close the window
+    telemetryWindow window;
+    memset(&window, 0, sizeof(window));
+    window.seq = seq;
+    window.firstSeq = seq++;
+    window.pulseCount = pulses;
+    window.reversePulseCount = (flags & FUZZ_FLAG_REVERSE) ? pulses / 2 : 0;
+    window.elapsedMs = elapsedMs;
+    window.tariffBand = (flags >> 4) % (TARIFF_BAND_MAX + 1);
+    window.reverseVolumeMls = pulsesToMls(window.reversePulseCount, reciprocal, factor);
+
+    // Frequency meter rate across the full 32-bit range, against a wide
+    // reference so an overflowed product can't hide below the saturation
+    window.frequencyMhz = value * 65537;
+    uint32_t rateMlsPerMin = frequencyToMlsPerMin(window.frequencyMhz, record.frequencyOffsetMhz, record.frequencyScaleQ16);
+    unsigned __int128 rate = window.frequencyMhz > record.frequencyOffsetMhz
+      ? (unsigned __int128)(window.frequencyMhz - record.frequencyOffsetMhz) * (uint64_t)record.frequencyScaleQ16 / (1000ULL << 16)
+      : 0;
+    FUZZ_CHECK(rateMlsPerMin == (rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate));
+
+    unsigned __int128 volume = (unsigned __int128)rateMlsPerMin * elapsedMs / 60000;
+    FUZZ_CHECK(rateToVolumeMls(rateMlsPerMin, elapsedMs) == (volume > UINT32_MAX ? UINT32_MAX : (uint32_t)volume));
+
+    if (frequencyMode)
+    {
+      window.volumeMls = rateToVolumeMls(rateMlsPerMin, elapsedMs);
+      frequencyVolumeMls += window.volumeMls;
+    }
+    else
+    {
+      window.volumeMls = pulsesToMls(pulses, reciprocal, factor);
+      FUZZ_CHECK(window.volumeMls == (uint64_t)pulses * 1000 / factor);
+      totalPulses += pulses;
+    }
+    totalReversePulses += window.reversePulseCount;
+
+    // Commit it, the running totals must never go backwards and must match
+    // converting every pulse since the last k-factor change in one go
+    uint64_t windowVolumeMls = commitTotals(&totals, &window, frequencyMode, reciprocal, factor);
+    FUZZ_CHECK(totals.pulseCount < (uint32_t)factor && totals.reversePulseCount < (uint32_t)factor);
+
+    uint64_t totalMls = getTotalVolumeMls(&totals, reciprocal, factor);
+    FUZZ_CHECK(totalMls == bankedVolumeMls + frequencyVolumeMls + totalPulses * 1000 / factor);
+    FUZZ_CHECK(getTotalReverseVolumeMls(&totals, reciprocal, factor) == bankedReverseVolumeMls + totalReversePulses * 1000 / factor);
+    FUZZ_CHECK(totalMls >= lastTotalMls && windowVolumeMls == totalMls - lastTotalMls);
+    FUZZ_CHECK(window.totalVolumeMls == totalMls);
+    lastTotalMls = totalMls;
+
+    // Every band's volume adds up to the total
+    uint64_t tariffMls = 0LL;
+    for (uint8_t band = 0; band <= TARIFF_BAND_MAX; band++)
+    {
+      tariffMls += totals.tariffVolumeMls[band];
+    }
+    FUZZ_CHECK(tariffMls == totalMls);
+
+    // Queue it (merging to make room once full), and publish the oldest
+    queueWindow(&queue, &window);
+    FUZZ_CHECK(queue.count <= BATCH_WINDOW_MAX);
+    for (uint8_t j = 1; j < queue.count; j++)
+    {
+      FUZZ_CHECK(queue.windows[j].firstSeq == queue.windows[j - 1].seq + 1);
+    }
+    FUZZ_CHECK(queue.windows[queue.count - 1].seq == window.seq);
+    queuedVolumeMls += window.volumeMls;
+    queuedPulses += window.pulseCount;
+
+    if (flags & FUZZ_FLAG_PUBLISH)
+    {
+      publishedVolumeMls += queue.windows[0].volumeMls;
+      publishedPulses += queue.windows[0].pulseCount;
+      FUZZ_CHECK(queue.windows[0].totalVolumeMls <= totalMls);
+      dequeueWindows(&queue, 1);
+    }
+  }
+
+  // Nothing lost from the queue (merged windows only saturate if the whole
+  // run overflows), or from the edge ring
+  for (uint8_t i = 0; i < queue.count; i++)
+  {
+    publishedVolumeMls += queue.windows[i].volumeMls;
+    publishedPulses += queue.windows[i].pulseCount;
+  }
+  FUZZ_CHECK(publishedVolumeMls <= queuedVolumeMls);
+  FUZZ_CHECK(queuedVolumeMls > UINT32_MAX || publishedVolumeMls == queuedVolumeMls);
+  FUZZ_CHECK(queuedPulses > UINT32_MAX || publishedPulses == queuedPulses);
+
+  uint8_t tail;
+  uint8_t head = peekEdges(&ring, &tail);
+  drained += (uint8_t)(head - tail);
+  FUZZ_CHECK(pushed == drained + ring.overflowCount);
+
+  return 0;
+}
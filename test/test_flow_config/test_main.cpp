@@ -0,0 +1,189 @@
+/**
+  Native unit tests for the flow sensor config parsing (lib/FlowMath)
+
+  Run with "pio test -e native"
+*/
+
+#include <unity.h>
+#include <FlowConfig.h>
+
+configRecord record;
+
+void setUp()
+{
+  // The firmware defaults, as at boot before any config
+  getDefaultConfigRecord(&record);
+}
+
+void tearDown() {}
+
+uint8_t parse(const char * payload)
+{
+  DynamicJsonDocument json(2048);
+  TEST_ASSERT_FALSE(deserializeJson(json, payload));
+  return parseMeasurementConfig(json.as<JsonVariant>(), &record);
+}
+
+void test_valid_config_is_applied()
+{
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"telemetryIntervalMs\":5000,\"kFactor\":450,\"rateFilterGain\":50,"
+    "\"minPulseFrequency\":0.5,\"frequencyScale\":2.5,\"frequencyOffsetHz\":1,\"referenceKFactor\":0,"
+    "\"driftWindowLitres\":10,\"driftAlertPermille\":5,\"inputMode\":\"frequency\",\"timezone\":\"NZST-12\"}"));
+
+  TEST_ASSERT_EQUAL_UINT32(5000, record.telemetryIntervalMs);
+  TEST_ASSERT_EQUAL_INT32(450, record.kFactor);
+  TEST_ASSERT_EQUAL_UINT8(50, record.rateFilterGain);
+  TEST_ASSERT_EQUAL_UINT32(4000, record.zeroFlowTimeoutMs);
+  TEST_ASSERT_TRUE(record.frequencyScaleQ16 == 5 * 32768);
+  TEST_ASSERT_EQUAL_UINT32(1000, record.frequencyOffsetMhz);
+  TEST_ASSERT_EQUAL_UINT32(10000, record.driftWindowMls);
+  TEST_ASSERT_EQUAL_UINT32(5, record.driftAlertPermille);
+  TEST_ASSERT_EQUAL_UINT8(INPUT_MODE_FREQUENCY, record.inputMode);
+  TEST_ASSERT_EQUAL_STRING("NZST-12", record.posixTimezone);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_NTP_SERVER, record.ntpServer);
+}
+
+void test_invalid_ints_keep_previous_value()
+{
+  // Wrong type, out of range, too big for an int, or not whole
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":\"abc\"}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":0}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":-49}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":1001}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":5e9}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":49.5}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"kFactor\":null}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"telemetryIntervalMs\":4294967296}"));
+  TEST_ASSERT_EQUAL_UINT8(2, parse("{\"rateFilterGain\":[],\"driftWindowLitres\":{}}"));
+
+  TEST_ASSERT_EQUAL_INT32(DEFAULT_K_FACTOR, record.kFactor);
+  TEST_ASSERT_EQUAL_UINT32(DEFAULT_TELEMETRY_INTERVAL_MS, record.telemetryIntervalMs);
+  TEST_ASSERT_EQUAL_UINT8(DEFAULT_RATE_FILTER_GAIN, record.rateFilterGain);
+  TEST_ASSERT_EQUAL_UINT32(DEFAULT_DRIFT_WINDOW_LITRES * 1000, record.driftWindowMls);
+}
+
+void test_invalid_floats_keep_previous_value()
+{
+  uint32_t zeroFlowTimeoutMs = record.zeroFlowTimeoutMs;
+
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"minPulseFrequency\":0}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"minPulseFrequency\":\"2\"}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"minPulseFrequency\":1e39}"));
+  TEST_ASSERT_EQUAL_UINT8(2, parse("{\"frequencyScale\":-1,\"frequencyOffsetHz\":true}"));
+
+  TEST_ASSERT_EQUAL_UINT32(zeroFlowTimeoutMs, record.zeroFlowTimeoutMs);
+  TEST_ASSERT_TRUE(record.frequencyScaleQ16 == 65536);
+  TEST_ASSERT_EQUAL_UINT32(0, record.frequencyOffsetMhz);
+}
+
+void test_invalid_strings_keep_previous_value()
+{
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"inputMode\":\"quadrature\",\"timezone\":\"NZST-12\"}"));
+
+  TEST_ASSERT_EQUAL_UINT8(3, parse("{\"inputMode\":\"bogus\",\"timezone\":12,"
+    "\"ntpServer\":\"a-very-long-ntp-server-name-which-would-never-fit.example.com.invalid\"}"));
+  TEST_ASSERT_EQUAL_UINT8(INPUT_MODE_QUADRATURE, record.inputMode);
+  TEST_ASSERT_EQUAL_STRING("NZST-12", record.posixTimezone);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_NTP_SERVER, record.ntpServer);
+
+  // Null goes back to the default
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"timezone\":null}"));
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_TIMEZONE, record.posixTimezone);
+}
+
+void test_tariff_bands()
+{
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"tariffBands\":[{\"days\":\"weekday\",\"start\":\"07:00\",\"end\":\"23:00\"},"
+    "{\"start\":\"23:00\",\"end\":\"7:00\"}]}"));
+  TEST_ASSERT_EQUAL_UINT8(2, record.tariffBandCount);
+  TEST_ASSERT_EQUAL_UINT8(TARIFF_DAYS_WEEKDAY, record.tariffBands[0].days);
+  TEST_ASSERT_EQUAL_UINT16(7 * 60, record.tariffBands[0].startMinute);
+  TEST_ASSERT_EQUAL_UINT16(23 * 60, record.tariffBands[0].endMinute);
+  TEST_ASSERT_EQUAL_UINT8(TARIFF_DAYS_ALL, record.tariffBands[1].days);
+  TEST_ASSERT_EQUAL_UINT16(7 * 60, record.tariffBands[1].endMinute);
+
+  // Any bad band rejects the whole set, leaving the current bands alone
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"tariffBands\":[{\"start\":\"07:00\",\"end\":\"25:00\"}]}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"tariffBands\":[{\"start\":\"07:60\",\"end\":\"08:00\"}]}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"tariffBands\":[{\"days\":\"monday\",\"start\":\"07:00\",\"end\":\"08:00\"}]}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"tariffBands\":[{\"days\":5,\"start\":\"07:00\",\"end\":\"08:00\"}]}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"tariffBands\":[{},{},{},{},{}]}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parse("{\"tariffBands\":\"07:00-23:00\"}"));
+  TEST_ASSERT_EQUAL_UINT8(2, record.tariffBandCount);
+
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"tariffBands\":[]}"));
+  TEST_ASSERT_EQUAL_UINT8(0, record.tariffBandCount);
+}
+
+void test_output_config()
+{
+  uint32_t fieldMask = DEFAULT_TELEMETRY_FIELD_MASK;
+  bool envelopeMode = false;
+  bool shortKeys = false;
+
+  DynamicJsonDocument json(2048);
+  TEST_ASSERT_FALSE(deserializeJson(json, "{\"telemetryFields\":[\"seq\",\"volumeMls\"],\"envelopeMode\":true,\"shortKeys\":true}"));
+  TEST_ASSERT_EQUAL_UINT8(0, parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys));
+  TEST_ASSERT_EQUAL_HEX32((1UL << FIELD_SEQ) | (1UL << FIELD_VOLUME), fieldMask);
+  TEST_ASSERT_TRUE(envelopeMode);
+  TEST_ASSERT_TRUE(shortKeys);
+
+  // A list that isn't one, or has any unknown key, leaves the fields alone
+  // rather than clearing them, and bools must really be bools
+  TEST_ASSERT_FALSE(deserializeJson(json, "{\"telemetryFields\":\"seq\",\"envelopeMode\":1,\"shortKeys\":\"false\"}"));
+  TEST_ASSERT_EQUAL_UINT8(3, parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys));
+  TEST_ASSERT_FALSE(deserializeJson(json, "{\"telemetryFields\":[\"seq\",\"bogus\"],\"envelopeMode\":null}"));
+  TEST_ASSERT_EQUAL_UINT8(2, parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys));
+  TEST_ASSERT_FALSE(deserializeJson(json, "{\"telemetryFields\":[\"seq\",7]}"));
+  TEST_ASSERT_EQUAL_UINT8(1, parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys));
+  TEST_ASSERT_EQUAL_HEX32((1UL << FIELD_SEQ) | (1UL << FIELD_VOLUME), fieldMask);
+  TEST_ASSERT_TRUE(envelopeMode);
+  TEST_ASSERT_TRUE(shortKeys);
+
+  // An empty list is valid, and every known key can be selected
+  TEST_ASSERT_FALSE(deserializeJson(json, "{\"telemetryFields\":[]}"));
+  TEST_ASSERT_EQUAL_UINT8(0, parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys));
+  TEST_ASSERT_EQUAL_HEX32(0, fieldMask);
+
+  JsonArray fields = json.to<JsonObject>().createNestedArray("telemetryFields");
+  for (uint8_t field = 0; field < FIELD_COUNT; field++)
+  {
+    fields.add(FIELD_KEYS[field][0]);
+  }
+  TEST_ASSERT_EQUAL_UINT8(0, parseOutputConfig(json.as<JsonVariant>(), &fieldMask, &envelopeMode, &shortKeys));
+  TEST_ASSERT_EQUAL_HEX32((1UL << FIELD_COUNT) - 1, fieldMask);
+}
+
+void test_parsed_config_is_within_limits()
+{
+  // Extremes that are accepted must already be within the limits loadConfig()
+  // enforces, so a saved record reloads unchanged
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"telemetryIntervalMs\":60000,\"kFactor\":1000,\"rateFilterGain\":1,"
+    "\"minPulseFrequency\":0.05,\"frequencyScale\":100000,\"frequencyOffsetHz\":10000,\"referenceKFactor\":1000,"
+    "\"driftWindowLitres\":100000,\"driftAlertPermille\":500}"));
+
+  configRecord constrained = record;
+  constrainConfigRecord(&constrained);
+  TEST_ASSERT_EQUAL_INT(0, memcmp(&record, &constrained, sizeof(record)));
+
+  TEST_ASSERT_EQUAL_UINT8(0, parse("{\"minPulseFrequency\":1000}"));
+
+  constrained = record;
+  constrainConfigRecord(&constrained);
+  TEST_ASSERT_EQUAL_INT(0, memcmp(&record, &constrained, sizeof(record)));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+
+  RUN_TEST(test_valid_config_is_applied);
+  RUN_TEST(test_invalid_ints_keep_previous_value);
+  RUN_TEST(test_invalid_floats_keep_previous_value);
+  RUN_TEST(test_invalid_strings_keep_previous_value);
+  RUN_TEST(test_tariff_bands);
+  RUN_TEST(test_output_config);
+  RUN_TEST(test_parsed_config_is_within_limits);
+
+  return UNITY_END();
+}
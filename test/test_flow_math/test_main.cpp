@@ -0,0 +1,363 @@
+/**
+  Native unit tests for the flow sensor measurement maths (lib/FlowMath)
+
+  Run with "pio test -e native"
+*/
+
+#include <unity.h>
+#include <FlowMath.h>
+
+// 1kHz input, i.e. 1000us between edges
+#define   STRESS_INTERVAL_US              1000
+#define   STRESS_STALL_MS                 5000
+
+// Zero-flow timeout at the default 2Hz minimum pulse frequency
+#define   STRESS_ZERO_FLOW_MS             1000
+
+void setUp() {}
+void tearDown() {}
+
+/*--------------------------- Volume ----------------------------------*/
+void checkVolume(uint32_t pulses, int32_t factor, uint64_t reciprocal)
+{
+  uint32_t expected = (uint32_t)((uint64_t)pulses * 1000 / factor);
+  if (pulsesToMls(pulses, reciprocal, factor) != expected)
+  {
+    char message[64];
+    snprintf(message, sizeof(message), "pulses: %u, k-factor: %d", (unsigned)pulses, (int)factor);
+    TEST_FAIL_MESSAGE(message);
+  }
+}
+
+void test_reciprocal_is_bit_exact()
+{
+  // Every k-factor, against every count up to a few hundred litres, then
+  // a stride through to the largest exact count and everything just below it
+  for (int32_t factor = 1; factor <= K_FACTOR_MAX; factor++)
+  {
+    uint64_t reciprocal = getVolumeReciprocal(factor);
+
+    for (uint32_t pulses = 0; pulses <= 100000; pulses++)
+    {
+      checkVolume(pulses, factor, reciprocal);
+    }
+
+    for (uint32_t pulses = 100000; pulses <= VOLUME_RECIPROCAL_PULSES_MAX; pulses += 997)
+    {
+      checkVolume(pulses, factor, reciprocal);
+    }
+
+    for (uint32_t pulses = VOLUME_RECIPROCAL_PULSES_MAX - 2 * factor; pulses <= VOLUME_RECIPROCAL_PULSES_MAX; pulses++)
+    {
+      checkVolume(pulses, factor, reciprocal);
+    }
+  }
+}
+
+void test_reciprocal_falls_back_beyond_exact_range()
+{
+  for (int32_t factor = 1; factor <= K_FACTOR_MAX; factor += 37)
+  {
+    uint64_t reciprocal = getVolumeReciprocal(factor);
+    checkVolume(VOLUME_RECIPROCAL_PULSES_MAX + 1, factor, reciprocal);
+    checkVolume(UINT32_MAX / 2, factor, reciprocal);
+    checkVolume(UINT32_MAX, factor, reciprocal);
+  }
+}
+
+void test_fold_is_exact()
+{
+  // Folding as pulses arrive must give the same total as converting them
+  // all at once, and leave less than a litre's worth of pulses behind
+  for (int32_t factor = 1; factor <= K_FACTOR_MAX; factor += 7)
+  {
+    uint64_t reciprocal = getVolumeReciprocal(factor);
+    uint64_t baseVolumeMls = 0LL;
+    uint32_t pulses = 0L;
+    uint64_t totalPulses = 0LL;
+    uint64_t lastTotalMls = 0LL;
+
+    for (uint32_t window = 0; window < 2000; window++)
+    {
+      uint32_t windowPulses = (window * 7919) % 5000;
+      pulses += windowPulses;
+      totalPulses += windowPulses;
+      foldTotal(&baseVolumeMls, &pulses, reciprocal, factor);
+
+      uint64_t totalMls = baseVolumeMls + pulsesToMls(pulses, reciprocal, factor);
+      TEST_ASSERT_LESS_THAN_UINT32(factor, pulses);
+      TEST_ASSERT_TRUE(totalMls == totalPulses * 1000 / factor);
+      TEST_ASSERT_TRUE(totalMls >= lastTotalMls);
+      lastTotalMls = totalMls;
+    }
+  }
+}
+
+/*--------------------------- Windows ---------------------------------*/
+void test_frequency_rate()
+{
+  // 1Hz above a 0.5Hz offset at 2 mL/min per Hz
+  TEST_ASSERT_EQUAL_UINT32(2, frequencyToMlsPerMin(1500, 500, 2 * 65536));
+  TEST_ASSERT_EQUAL_UINT32(0, frequencyToMlsPerMin(500, 500, 2 * 65536));
+  TEST_ASSERT_EQUAL_UINT32(0, frequencyToMlsPerMin(1500, 500, 0));
+
+  // Saturates rather than wrapping, including just past where the product
+  // overflows 64 bits (which would otherwise wrap to 89 mL/min)
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, frequencyToMlsPerMin(UINT32_MAX, 0, (int64_t)(FREQUENCY_SCALE_MAX * 65536)));
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, frequencyToMlsPerMin(2814749768UL, 0, (int64_t)(FREQUENCY_SCALE_MAX * 65536)));
+
+  // Exact across the range, against a wide product
+  for (uint32_t frequencyMhz = 1; frequencyMhz < UINT32_MAX / 3; frequencyMhz = frequencyMhz * 3 + 1)
+  {
+    for (int64_t scaleQ16 = 1; scaleQ16 <= (int64_t)(FREQUENCY_SCALE_MAX * 65536); scaleQ16 = scaleQ16 * 5 + 3)
+    {
+      unsigned __int128 rate = (unsigned __int128)frequencyMhz * (uint64_t)scaleQ16 / (1000ULL << 16);
+      TEST_ASSERT_EQUAL_UINT32(rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate, frequencyToMlsPerMin(frequencyMhz, 0, scaleQ16));
+    }
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, rateToVolumeMls(UINT32_MAX, UINT32_MAX));
+  TEST_ASSERT_EQUAL_UINT32(500, rateToVolumeMls(1000, 30000));
+}
+
+void test_merge_window()
+{
+  telemetryWindow earlier;
+  telemetryWindow later;
+  memset(&earlier, 0, sizeof(earlier));
+  memset(&later, 0, sizeof(later));
+
+  earlier.seq = 1;
+  earlier.firstSeq = 1;
+  earlier.elapsedMs = 1000;
+  earlier.pulseCount = 49;
+  earlier.volumeMls = 1000;
+  earlier.rateMlsPerMin = 60000;
+  earlier.quality = 0x01;
+  earlier.edgeOverflowCount = 3;
+
+  later.seq = 2;
+  later.firstSeq = 2;
+  later.elapsedMs = 3000;
+  later.pulseCount = 98;
+  later.volumeMls = 2000;
+  later.rateMlsPerMin = 40000;
+  later.quality = 0x04;
+  later.totalVolumeMls = 3000;
+
+  mergeWindow(&earlier, &later);
+
+  TEST_ASSERT_EQUAL_UINT32(2, earlier.seq);
+  TEST_ASSERT_EQUAL_UINT32(1, earlier.firstSeq);
+  TEST_ASSERT_EQUAL_UINT32(4000, earlier.elapsedMs);
+  TEST_ASSERT_EQUAL_UINT32(147, earlier.pulseCount);
+  TEST_ASSERT_EQUAL_UINT32(3000, earlier.volumeMls);
+  TEST_ASSERT_EQUAL_INT32(45000, earlier.rateMlsPerMin);
+  TEST_ASSERT_EQUAL_UINT8(0x05, earlier.quality);
+  TEST_ASSERT_EQUAL_UINT32(3, earlier.edgeOverflowCount);
+  TEST_ASSERT_TRUE(earlier.totalVolumeMls == 3000);
+
+  // A long outage saturates rather than wrapping
+  later.volumeMls = UINT32_MAX - 1000;
+  later.elapsedMs = UINT32_MAX;
+  mergeWindow(&earlier, &later);
+
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, earlier.volumeMls);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, earlier.elapsedMs);
+  TEST_ASSERT_EQUAL_UINT32(245, earlier.pulseCount);
+}
+
+void test_queue_window()
+{
+  // A full queue halves its resolution to make room, never merging across
+  // a boot, and keeps every pulse
+  static telemetryQueue queue;
+  memset(&queue, 0, sizeof(queue));
+
+  telemetryWindow window;
+  memset(&window, 0, sizeof(window));
+  window.pulseCount = 10;
+  window.elapsedMs = 1000;
+
+  for (uint8_t i = 0; i < BATCH_WINDOW_MAX; i++)
+  {
+    window.boot = i < 3 ? 1 : 2;
+    window.seq = i;
+    window.firstSeq = i;
+    TEST_ASSERT_EQUAL_UINT8(0, queueWindow(&queue, &window));
+  }
+
+  window.seq = BATCH_WINDOW_MAX;
+  window.firstSeq = BATCH_WINDOW_MAX;
+  TEST_ASSERT_EQUAL_UINT8(BATCH_WINDOW_MAX / 2 - 1, queueWindow(&queue, &window));
+  TEST_ASSERT_EQUAL_UINT8(BATCH_WINDOW_MAX / 2 + 2, queue.count);
+
+  // Boot 1 had three windows, so the last of them stays on its own
+  TEST_ASSERT_EQUAL_UINT32(20, queue.windows[0].pulseCount);
+  TEST_ASSERT_EQUAL_UINT32(0, queue.windows[0].firstSeq);
+  TEST_ASSERT_EQUAL_UINT32(1, queue.windows[0].seq);
+  TEST_ASSERT_EQUAL_UINT32(10, queue.windows[1].pulseCount);
+  TEST_ASSERT_EQUAL_UINT32(1, queue.windows[1].boot);
+  TEST_ASSERT_EQUAL_UINT32(2, queue.windows[2].boot);
+
+  // Each window carries on from the seq the one before it ended at
+  uint32_t pulses = 0L;
+  for (uint8_t i = 0; i < queue.count; i++)
+  {
+    pulses += queue.windows[i].pulseCount;
+    TEST_ASSERT_EQUAL_UINT32(i > 0 ? queue.windows[i - 1].seq + 1 : 0, queue.windows[i].firstSeq);
+  }
+  TEST_ASSERT_EQUAL_UINT32((BATCH_WINDOW_MAX + 1) * 10, pulses);
+
+  dequeueWindows(&queue, 2);
+  TEST_ASSERT_EQUAL_UINT8(BATCH_WINDOW_MAX / 2, queue.count);
+  TEST_ASSERT_EQUAL_UINT32(2, queue.windows[0].boot);
+}
+
+void test_acked_window_count()
+{
+  // Two windows replayed from the last boot, then a merged one and a single
+  // one from this boot
+  static telemetryQueue queue;
+  memset(&queue, 0, sizeof(queue));
+
+  telemetryWindow window;
+  memset(&window, 0, sizeof(window));
+
+  const uint32_t windows[4][3] = { { 1, 5, 5 }, { 1, 6, 6 }, { 2, 0, 1 }, { 2, 2, 2 } };
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    window.boot = windows[i][0];
+    window.firstSeq = windows[i][1];
+    window.seq = windows[i][2];
+    queueWindow(&queue, &window);
+  }
+
+  // Cumulative from the oldest, never past a boot or a window not yet acked
+  TEST_ASSERT_EQUAL_UINT8(0, getAckedWindowCount(&queue, 1, 4));
+  TEST_ASSERT_EQUAL_UINT8(1, getAckedWindowCount(&queue, 1, 5));
+  TEST_ASSERT_EQUAL_UINT8(2, getAckedWindowCount(&queue, 1, UINT32_MAX));
+  TEST_ASSERT_EQUAL_UINT8(0, getAckedWindowCount(&queue, 2, 2));
+
+  // A merged window is only done with once its last seq is acked
+  dequeueWindows(&queue, 2);
+  TEST_ASSERT_EQUAL_UINT8(0, getAckedWindowCount(&queue, 2, 0));
+  TEST_ASSERT_EQUAL_UINT8(1, getAckedWindowCount(&queue, 2, 1));
+  TEST_ASSERT_EQUAL_UINT8(2, getAckedWindowCount(&queue, 2, 2));
+}
+
+/*--------------------------- Edges -----------------------------------*/
+void test_edge_ring_survives_stall()
+{
+  // kHz input, drained every millisecond apart from a multi-second stall,
+  // every edge must be either drained (in order) or counted as an overflow
+  static edgeRing ring;
+  memset((void *)&ring, 0, sizeof(ring));
+
+  // The timer wraps partway through the run
+  uint32_t now = 0xFFFFFFFFUL - 2000000UL;
+  edgeActivity activity;
+  resetEdgeActivity(&activity, &ring, now);
+
+  uint32_t pushed = 0L;
+  uint32_t drained = 0L;
+  uint32_t lastMicros = 0L;
+  uint32_t overflowsAfterStall = 0L;
+
+  for (uint32_t ms = 0; ms < 3 * STRESS_STALL_MS; ms++)
+  {
+    now += STRESS_INTERVAL_US;
+    pushEdge(&ring, now);
+    pushed++;
+
+    bool stalled = ms >= STRESS_STALL_MS && ms < 2 * STRESS_STALL_MS;
+    if (stalled)
+      continue;
+
+    uint8_t tail;
+    uint8_t head = peekEdges(&ring, &tail);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT8(EDGE_BUFFER_SIZE, (uint8_t)(head - tail));
+
+    for (uint8_t i = tail; i != head; i++)
+    {
+      uint32_t edge = getEdge(&ring, i);
+      if (drained > 0)
+      {
+        TEST_ASSERT_TRUE((int32_t)(edge - lastMicros) > 0);
+      }
+      lastMicros = edge;
+      drained++;
+    }
+    releaseEdges(&ring, head);
+
+    // Zero flow must not be detected as the stall is drained, even though
+    // the newest edge left in the buffer is from just after it started
+    TEST_ASSERT_LESS_THAN_UINT32(STRESS_ZERO_FLOW_MS, getEdgeIdleMs(&activity, &ring, lastMicros, now));
+
+    if (ms == 2 * STRESS_STALL_MS)
+    {
+      overflowsAfterStall = ring.overflowCount;
+    }
+  }
+
+  // The stall filled the buffer and overflowed, then timing recovered
+  TEST_ASSERT_EQUAL_UINT32(STRESS_STALL_MS + 1 - EDGE_BUFFER_SIZE, overflowsAfterStall);
+  TEST_ASSERT_EQUAL_UINT32(overflowsAfterStall, ring.overflowCount);
+  TEST_ASSERT_EQUAL_UINT32(pushed, drained + ring.overflowCount);
+
+  // Once the edges really stop, zero flow is detected after the timeout
+  TEST_ASSERT_LESS_THAN_UINT32(STRESS_ZERO_FLOW_MS, getEdgeIdleMs(&activity, &ring, lastMicros, now + (STRESS_ZERO_FLOW_MS - 1) * 1000));
+  TEST_ASSERT_EQUAL_UINT32(STRESS_ZERO_FLOW_MS, getEdgeIdleMs(&activity, &ring, lastMicros, now + STRESS_ZERO_FLOW_MS * 1000));
+}
+
+/*--------------------------- Config ----------------------------------*/
+void test_constrain_config_record()
+{
+  configRecord record;
+  memset(&record, 0xFF, sizeof(record));
+
+  constrainConfigRecord(&record);
+
+  TEST_ASSERT_EQUAL_UINT32(TELEMETRY_INTERVAL_MS_MAX, record.telemetryIntervalMs);
+  TEST_ASSERT_EQUAL_INT32(1, record.kFactor);
+  TEST_ASSERT_EQUAL_UINT32(ZERO_FLOW_TIMEOUT_MS_MAX, record.zeroFlowTimeoutMs);
+  TEST_ASSERT_TRUE(record.frequencyScaleQ16 == 0);
+  TEST_ASSERT_EQUAL_INT32(0, record.referenceKFactor);
+  TEST_ASSERT_EQUAL_UINT32(DRIFT_WINDOW_LITRES_MAX * 1000, record.driftWindowMls);
+  TEST_ASSERT_EQUAL_UINT32(DRIFT_ALERT_PERMILLE_MAX, record.driftAlertPermille);
+  TEST_ASSERT_EQUAL_UINT8(RATE_FILTER_GAIN_MAX, record.rateFilterGain);
+  TEST_ASSERT_EQUAL_UINT8(INPUT_MODE_PULSE, record.inputMode);
+  TEST_ASSERT_EQUAL_UINT8(TARIFF_BAND_MAX, record.tariffBandCount);
+  TEST_ASSERT_EQUAL_UINT8(TARIFF_DAYS_ALL, record.tariffBands[0].days);
+  TEST_ASSERT_EQUAL_UINT16(TARIFF_MINUTE_MAX, record.tariffBands[0].startMinute);
+  TEST_ASSERT_EQUAL_UINT32(TIMEZONE_MAX_LENGTH - 1, strlen(record.posixTimezone));
+
+  // Zeroed (e.g. an all-zero record) must not leave anything to divide by
+  memset(&record, 0, sizeof(record));
+  constrainConfigRecord(&record);
+
+  TEST_ASSERT_EQUAL_UINT32(1, record.telemetryIntervalMs);
+  TEST_ASSERT_EQUAL_INT32(1, record.kFactor);
+  TEST_ASSERT_EQUAL_UINT32(ZERO_FLOW_TIMEOUT_MS_MIN, record.zeroFlowTimeoutMs);
+  TEST_ASSERT_EQUAL_UINT32(1000, record.driftWindowMls);
+  TEST_ASSERT_EQUAL_UINT8(1, record.rateFilterGain);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_TIMEZONE, record.posixTimezone);
+  TEST_ASSERT_EQUAL_STRING(DEFAULT_NTP_SERVER, record.ntpServer);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+
+  RUN_TEST(test_reciprocal_is_bit_exact);
+  RUN_TEST(test_reciprocal_falls_back_beyond_exact_range);
+  RUN_TEST(test_fold_is_exact);
+  RUN_TEST(test_frequency_rate);
+  RUN_TEST(test_merge_window);
+  RUN_TEST(test_queue_window);
+  RUN_TEST(test_acked_window_count);
+  RUN_TEST(test_edge_ring_survives_stall);
+  RUN_TEST(test_constrain_config_record);
+
+  return UNITY_END();
+}